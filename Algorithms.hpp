@@ -0,0 +1,568 @@
+/*
+    Copyright 2016 Daniel Trugman
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef THREAD_POOL_ALGORITHMS_HPP
+#define THREAD_POOL_ALGORITHMS_HPP
+
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <vector>
+#include <system_error>
+#include <type_traits>
+#include <condition_variable>
+
+#include <cstddef>
+#include <cstdint>
+
+// ----------------------------------------------------------------------------
+// Parallel algorithms module decleration
+// ----------------------------------------------------------------------------
+
+namespace ThreadPoolDetail
+{
+    // Ranges this short are left to the sequential algorithms
+    static const size_t SORT_CUTOFF = 1 << 14;
+    static const size_t SCAN_CUTOFF = 1 << 15;
+
+    // Elements sampled per bucket when picking the sort's splitters
+    static const size_t OVERSAMPLING = 32;
+
+    static const size_t MAX_BUCKETS = 1024;
+
+    template < class Func >
+    struct Blocks
+    {
+        Blocks(const Func & func, size_t count)
+            : func(&func), count(count), next(0), done(0)
+        {}
+
+        // Takes blocks until there are none left. 'func' is only used for a
+        // block taken, so it's never used once the caller returned.
+        void work()
+        {
+            size_t block;
+
+            while ((block = next++) < count)
+            {
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+                try
+                {
+                    (*func)(block);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> guard(mutex);
+
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                }
+#else
+                (*func)(block);
+#endif
+
+                if (done.fetch_add(1) + 1 == count)
+                {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    finished.notify_all();
+                }
+            }
+        }
+
+        const Func *            func;
+        size_t                  count;
+        std::atomic<size_t>     next;
+        std::atomic<size_t>     done;
+        std::mutex              mutex;
+        std::condition_variable finished;
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+        std::exception_ptr      error;
+#endif
+    };
+
+    // Calls 'func' for every block in [0, count) on the pool's workers and
+    // on the calling thread, which takes blocks too. It only waits for the
+    // blocks running elsewhere, never for tasks still queued, so it can be
+    // called from the pool's own tasks. Rethrows the first exception.
+    template < class Func >
+    void forEachBlock(ThreadPool & pool, size_t count, const Func & func)
+    {
+        if (count == 0)
+        {
+            return;
+        }
+
+        std::shared_ptr<Blocks<Func>> blocks = std::make_shared<Blocks<Func>>(func, count);
+
+        size_t helpers = std::min(count - 1, pool.stats().active);
+
+        for (size_t i = 0; i < helpers; i++)
+        {
+            std::error_code ec;
+            pool.tryAddTask(ec, [blocks]() noexcept { blocks->work(); });
+
+            if (ec)
+            {
+                break;
+            }
+        }
+
+        blocks->work();
+
+        {
+            std::unique_lock<std::mutex> lock(blocks->mutex);
+            blocks->finished.wait(lock, [&blocks](){ return blocks->done == blocks->count; });
+        }
+
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+        if (blocks->error)
+        {
+            std::rethrow_exception(blocks->error);
+        }
+#endif
+    }
+
+    // The range [begin, end) of the given block, out of 'blocks' even ones
+    inline size_t blockBegin(size_t size, size_t blocks, size_t block)
+    {
+        return static_cast<size_t>(static_cast<uint64_t>(size) * block / blocks);
+    }
+
+    // Blocks for the two pass algorithms, a few per thread, so a slow one
+    // doesn't hold up the others, but none shorter than the cutoff
+    inline size_t scanBlocks(ThreadPool & pool, size_t size)
+    {
+        return std::max<size_t>(1, std::min((pool.stats().active + 1) * 4, size / SCAN_CUTOFF));
+    }
+
+    // Counts each block's elements matching 'pred', returning the total and
+    // leaving where every block's matches go (exclusive prefix sums)
+    template < class RandomIt, class Predicate >
+    size_t countBlocks(ThreadPool & pool, RandomIt first, size_t size, size_t blocks,
+                       Predicate & pred, std::vector<size_t> & offsets)
+    {
+        offsets.assign(blocks, 0);
+
+        forEachBlock(pool, blocks, [&](size_t block)
+        {
+            size_t count = 0;
+
+            // Without branches, so simple predicates vectorize
+            for (size_t i = blockBegin(size, blocks, block); i < blockBegin(size, blocks, block + 1); i++)
+            {
+                count += pred(first[i]) ? 1 : 0;
+            }
+
+            offsets[block] = count;
+        });
+
+        size_t total = 0;
+
+        for (size_t & offset : offsets)
+        {
+            size_t count = offset;
+            offset = total;
+            total += count;
+        }
+
+        return total;
+    }
+
+    // Outputs written by block in parallel are reached by offset
+    template < class It >
+    struct IsRandomAccess
+        : std::is_base_of<std::random_access_iterator_tag, typename std::iterator_traits<It>::iterator_category>
+    {};
+
+    // Uninitialized storage for the elements moved out of a range
+    template < class T >
+    struct Buffer
+    {
+        explicit Buffer(size_t size)
+            : data(std::allocator<T>().allocate(size)), size(size)
+        {}
+
+        ~Buffer()
+        {
+            std::allocator<T>().deallocate(data, size);
+        }
+
+        Buffer(const Buffer &) = delete;
+        Buffer & operator=(const Buffer &) = delete;
+
+        T *    data;
+        size_t size;
+    };
+}
+
+// Sorts [first, last) on the pool's workers and the calling thread, using a
+// sample sort: splitters picked from a sample divide the elements into about
+// four buckets per worker, which are counted and moved per block in
+// parallel, then sorted in parallel. Not stable, and moves the elements
+// through a temporary buffer of the same size (moves must not throw).
+// Ranges shorter than SORT_CUTOFF are sorted with std::sort.
+template < class RandomIt, class Compare >
+void parallelSort(ThreadPool & pool, RandomIt first, RandomIt last, Compare comp)
+{
+    using namespace ThreadPoolDetail;
+
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    size_t size = static_cast<size_t>(last - first);
+
+    if (size <= SORT_CUTOFF)
+    {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    size_t threads = pool.stats().active + 1;
+
+    size_t buckets = std::min(std::min(threads * 4, MAX_BUCKETS), size / SORT_CUTOFF + 1);
+    size_t blocks = buckets;
+
+    // Splitters are elements of the range, compared through their offsets,
+    // so the elements needn't be copyable. Each bucket takes the elements
+    // not greater than its splitter, and the last one takes the rest.
+    std::vector<size_t> sample(buckets * OVERSAMPLING);
+    for (size_t i = 0; i < sample.size(); i++)
+    {
+        sample[i] = blockBegin(size, sample.size(), i) + (i * 7919) % (size / sample.size());
+    }
+
+    std::sort(sample.begin(), sample.end(),
+              [&](size_t a, size_t b) { return comp(first[a], first[b]); });
+
+    std::vector<size_t> splitters(buckets - 1);
+    for (size_t i = 0; i < splitters.size(); i++)
+    {
+        splitters[i] = sample[(i + 1) * OVERSAMPLING];
+    }
+
+    // Classifies every element once, counting each block's buckets
+    std::vector<uint16_t> ids(size);
+    std::vector<size_t> counts(blocks * buckets, 0);
+
+    forEachBlock(pool, blocks, [&](size_t block)
+    {
+        size_t * count = &counts[block * buckets];
+
+        for (size_t i = blockBegin(size, blocks, block); i < blockBegin(size, blocks, block + 1); i++)
+        {
+            const value_type & value = first[i];
+
+            size_t id = std::lower_bound(splitters.begin(), splitters.end(), value,
+                                         [&](size_t splitter, const value_type & v) { return comp(first[splitter], v); })
+                        - splitters.begin();
+
+            ids[i] = static_cast<uint16_t>(id);
+            count[id]++;
+        }
+    });
+
+    // Where every block's share of every bucket goes, buckets in order and
+    // blocks in order within them
+    std::vector<size_t> starts(buckets + 1, 0);
+    size_t offset = 0;
+
+    for (size_t bucket = 0; bucket < buckets; bucket++)
+    {
+        starts[bucket] = offset;
+
+        for (size_t block = 0; block < blocks; block++)
+        {
+            size_t & count = counts[block * buckets + bucket];
+            size_t blockCount = count;
+            count = offset;
+            offset += blockCount;
+        }
+    }
+    starts[buckets] = offset;
+
+    Buffer<value_type> buffer(size);
+
+    forEachBlock(pool, blocks, [&](size_t block)
+    {
+        size_t * next = &counts[block * buckets];
+
+        for (size_t i = blockBegin(size, blocks, block); i < blockBegin(size, blocks, block + 1); i++)
+        {
+            ::new (static_cast<void *>(buffer.data + next[ids[i]]++)) value_type(std::move(first[i]));
+        }
+    });
+
+    // Every bucket is moved back to its place, then sorted there
+    forEachBlock(pool, buckets, [&](size_t bucket)
+    {
+        value_type * begin = buffer.data + starts[bucket];
+        value_type * end = buffer.data + starts[bucket + 1];
+
+        RandomIt out = first + static_cast<ptrdiff_t>(starts[bucket]);
+        for (value_type * item = begin; item != end; ++item, ++out)
+        {
+            *out = std::move(*item);
+            item->~value_type();
+        }
+
+        std::sort(first + static_cast<ptrdiff_t>(starts[bucket]),
+                  first + static_cast<ptrdiff_t>(starts[bucket + 1]), comp);
+    });
+}
+
+template < class RandomIt >
+void parallelSort(ThreadPool & pool, RandomIt first, RandomIt last)
+{
+    parallelSort(pool, first, last, std::less<typename std::iterator_traits<RandomIt>::value_type>());
+}
+
+// Scans use the classic two pass block scan: the first pass reduces every
+// block in parallel, a short sequential scan over the block sums gives each
+// block its carry, and the second pass scans every block from its carry in
+// parallel. 'op' must be associative, not necessarily commutative. The
+// blocks are written in parallel, so 'out' must be a random access iterator
+// to a range as long as the input (not e.g. a back_inserter), which may be
+// the input itself (in place). Ranges shorter than SCAN_CUTOFF are scanned
+// on the calling thread.
+
+// Writes op(first[0], ..., first[i]) to out[i], like std::inclusive_scan
+template < class RandomIt, class RandomOutputIt, class BinaryOp >
+RandomOutputIt parallelInclusiveScan(ThreadPool & pool, RandomIt first, RandomIt last, RandomOutputIt out, BinaryOp op)
+{
+    using namespace ThreadPoolDetail;
+
+    static_assert(IsRandomAccess<RandomOutputIt>::value, "'out' must be a random access iterator");
+
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    size_t size = static_cast<size_t>(last - first);
+
+    if (size <= SCAN_CUTOFF)
+    {
+        return std::partial_sum(first, last, out, op);
+    }
+
+    size_t blocks = scanBlocks(pool, size);
+
+    // The last block's sum isn't needed
+    std::vector<value_type> sums(blocks - 1, *first);
+
+    forEachBlock(pool, blocks - 1, [&](size_t block)
+    {
+        size_t begin = blockBegin(size, blocks, block);
+        size_t end = blockBegin(size, blocks, block + 1);
+
+        value_type sum = first[begin];
+        for (size_t i = begin + 1; i < end; i++)
+        {
+            sum = op(sum, first[i]);
+        }
+
+        sums[block] = sum;
+    });
+
+    for (size_t block = 1; block < sums.size(); block++)
+    {
+        sums[block] = op(sums[block - 1], sums[block]);
+    }
+
+    forEachBlock(pool, blocks, [&](size_t block)
+    {
+        size_t begin = blockBegin(size, blocks, block);
+        size_t end = blockBegin(size, blocks, block + 1);
+
+        value_type sum = block ? op(sums[block - 1], first[begin]) : first[begin];
+        out[begin] = sum;
+
+        for (size_t i = begin + 1; i < end; i++)
+        {
+            sum = op(sum, first[i]);
+            out[i] = sum;
+        }
+    });
+
+    return out + static_cast<ptrdiff_t>(size);
+}
+
+template < class RandomIt, class RandomOutputIt >
+RandomOutputIt parallelInclusiveScan(ThreadPool & pool, RandomIt first, RandomIt last, RandomOutputIt out)
+{
+    return parallelInclusiveScan(pool, first, last, out,
+                                 std::plus<typename std::iterator_traits<RandomIt>::value_type>());
+}
+
+// Writes op(init, first[0], ..., first[i - 1]) to out[i], like
+// std::exclusive_scan
+template < class RandomIt, class RandomOutputIt, class T, class BinaryOp >
+RandomOutputIt parallelExclusiveScan(ThreadPool & pool, RandomIt first, RandomIt last, RandomOutputIt out, T init, BinaryOp op)
+{
+    using namespace ThreadPoolDetail;
+
+    static_assert(IsRandomAccess<RandomOutputIt>::value, "'out' must be a random access iterator");
+
+    size_t size = static_cast<size_t>(last - first);
+    size_t blocks = size <= SCAN_CUTOFF ? 1 : scanBlocks(pool, size);
+
+    // Every block's carry, its sum first
+    std::vector<T> carries(blocks, init);
+
+    forEachBlock(pool, blocks - 1, [&](size_t block)
+    {
+        size_t begin = blockBegin(size, blocks, block);
+        size_t end = blockBegin(size, blocks, block + 1);
+
+        T sum = first[begin];
+        for (size_t i = begin + 1; i < end; i++)
+        {
+            sum = op(sum, first[i]);
+        }
+
+        carries[block + 1] = sum;
+    });
+
+    for (size_t block = 1; block < blocks; block++)
+    {
+        carries[block] = op(carries[block - 1], carries[block]);
+    }
+
+    forEachBlock(pool, blocks, [&](size_t block)
+    {
+        T sum = carries[block];
+
+        for (size_t i = blockBegin(size, blocks, block); i < blockBegin(size, blocks, block + 1); i++)
+        {
+            // Read before writing, for scanning in place
+            T next = op(sum, first[i]);
+            out[i] = sum;
+            sum = next;
+        }
+    });
+
+    return out + static_cast<ptrdiff_t>(size);
+}
+
+template < class RandomIt, class RandomOutputIt, class T >
+RandomOutputIt parallelExclusiveScan(ThreadPool & pool, RandomIt first, RandomIt last, RandomOutputIt out, T init)
+{
+    return parallelExclusiveScan(pool, first, last, out, init, std::plus<T>());
+}
+
+// Copies the elements matching 'pred' to 'out', in order, like std::copy_if.
+// Counts every block's matches in parallel, then copies them in parallel,
+// from where the blocks before them end, so 'out' must be a random access
+// iterator to a range long enough for the matches (not e.g. a
+// back_inserter). 'pred' is called twice per element.
+template < class RandomIt, class RandomOutputIt, class Predicate >
+RandomOutputIt parallelCopyIf(ThreadPool & pool, RandomIt first, RandomIt last, RandomOutputIt out, Predicate pred)
+{
+    using namespace ThreadPoolDetail;
+
+    static_assert(IsRandomAccess<RandomOutputIt>::value, "'out' must be a random access iterator");
+
+    size_t size = static_cast<size_t>(last - first);
+
+    if (size <= SCAN_CUTOFF)
+    {
+        return std::copy_if(first, last, out, pred);
+    }
+
+    size_t blocks = scanBlocks(pool, size);
+
+    std::vector<size_t> offsets;
+    size_t total = countBlocks(pool, first, size, blocks, pred, offsets);
+
+    forEachBlock(pool, blocks, [&](size_t block)
+    {
+        RandomOutputIt to = out + static_cast<ptrdiff_t>(offsets[block]);
+
+        for (size_t i = blockBegin(size, blocks, block); i < blockBegin(size, blocks, block + 1); i++)
+        {
+            if (pred(first[i]))
+            {
+                *to = first[i];
+                ++to;
+            }
+        }
+    });
+
+    return out + static_cast<ptrdiff_t>(total);
+}
+
+// Moves the elements matching 'pred' before the others, keeping their
+// order in both groups like std::stable_partition, and returns where the
+// others begin. Counts in parallel, then moves every element through a
+// temporary buffer in parallel (moves must not throw). 'pred' is called
+// twice per element, and must not throw the second time.
+template < class RandomIt, class Predicate >
+RandomIt parallelPartition(ThreadPool & pool, RandomIt first, RandomIt last, Predicate pred)
+{
+    using namespace ThreadPoolDetail;
+
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    size_t size = static_cast<size_t>(last - first);
+
+    if (size <= SCAN_CUTOFF)
+    {
+        return std::stable_partition(first, last, pred);
+    }
+
+    size_t blocks = scanBlocks(pool, size);
+
+    std::vector<size_t> offsets;
+    size_t total = countBlocks(pool, first, size, blocks, pred, offsets);
+
+    Buffer<value_type> buffer(size);
+
+    forEachBlock(pool, blocks, [&](size_t block)
+    {
+        size_t begin = blockBegin(size, blocks, block);
+        size_t end = blockBegin(size, blocks, block + 1);
+
+        // The others go after all the matches, and after the others of the
+        // blocks before
+        size_t matched = offsets[block];
+        size_t other = total + begin - offsets[block];
+
+        for (size_t i = begin; i < end; i++)
+        {
+            size_t to = pred(first[i]) ? matched++ : other++;
+            ::new (static_cast<void *>(buffer.data + to)) value_type(std::move(first[i]));
+        }
+    });
+
+    forEachBlock(pool, blocks, [&](size_t block)
+    {
+        for (size_t i = blockBegin(size, blocks, block); i < blockBegin(size, blocks, block + 1); i++)
+        {
+            first[i] = std::move(buffer.data[i]);
+            buffer.data[i].~value_type();
+        }
+    });
+
+    return first + static_cast<ptrdiff_t>(total);
+}
+
+#endif // THREAD_POOL_ALGORITHMS_HPP
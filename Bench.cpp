@@ -0,0 +1,396 @@
+/*
+    Copyright 2016 Daniel Trugman
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <cstdint>
+
+#include <algorithm>
+
+// std::execution::par to compare against, defined by SConstruct where the
+// standard library's parallel backend (TBB for libstdc++) can be linked
+#ifdef BENCH_PARALLEL_STL
+#include <execution>
+#endif
+
+#include <benchmark/benchmark.h>
+
+#include "ThreadPool.hpp"
+#include "Algorithms.hpp"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const size_t BATCH_SIZE = 1000;
+
+// Pool sizes every benchmark is reported across
+static void poolSizes(benchmark::internal::Benchmark * b)
+{
+    for (int size = 1; size <= 16; size *= 2)
+    {
+        b->Arg(size);
+    }
+}
+
+static void waitFor(const atomic<size_t> & counter, size_t value)
+{
+    while (counter.load(memory_order_acquire) < value)
+    {
+        this_thread::yield();
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Empty tasks submitted through addTask, from submission until all ran
+// ----------------------------------------------------------------------------
+
+static void BM_EmptyTaskThroughput(benchmark::State & state)
+{
+    ThreadPool tp(state.range(0));
+    atomic<size_t> done(0);
+    size_t expected = 0;
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < BATCH_SIZE; i++)
+        {
+            tp.addTask([&done]() { done.fetch_add(1, memory_order_release); });
+        }
+
+        expected += BATCH_SIZE;
+        waitFor(done, expected);
+    }
+
+    state.SetItemsProcessed(state.iterations() * BATCH_SIZE);
+}
+BENCHMARK(BM_EmptyTaskThroughput)->Apply(poolSizes)->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// Time from addTask until a worker starts running the task
+// ----------------------------------------------------------------------------
+
+static void BM_SubmitToStartLatency(benchmark::State & state)
+{
+    ThreadPool tp(state.range(0));
+    double totalNs = 0;
+
+    for (auto _ : state)
+    {
+        Clock::time_point submitted = Clock::now();
+
+        Clock::time_point started = tp.addTask([]() { return Clock::now(); }).get();
+
+        totalNs += chrono::duration<double, nano>(started - submitted).count();
+    }
+
+    state.counters["latency_ns"] = benchmark::Counter(totalNs, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_SubmitToStartLatency)->Apply(poolSizes)->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// Time to wake a sleeping worker: from addTask on an idle pool until the task
+// starts, against a thread sleeping on a mutex and condition variable (how the
+// workers used to sleep)
+// ----------------------------------------------------------------------------
+
+static const chrono::microseconds SETTLE_TIME(200); // Lets the workers fall asleep
+
+static void BM_WakeLatency(benchmark::State & state)
+{
+    ThreadPool tp(state.range(0));
+    double totalNs = 0;
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        this_thread::sleep_for(SETTLE_TIME);
+        state.ResumeTiming();
+
+        Clock::time_point submitted = Clock::now();
+
+        Clock::time_point started = tp.addTask([]() { return Clock::now(); }).get();
+
+        totalNs += chrono::duration<double, nano>(started - submitted).count();
+    }
+
+    state.counters["latency_ns"] = benchmark::Counter(totalNs, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_WakeLatency)->Apply(poolSizes)->UseRealTime();
+
+static void BM_WakeLatencyCondvar(benchmark::State & state)
+{
+    mutex m;
+    condition_variable cond;
+    bool signaled = false;
+    bool exit = false;
+    atomic<size_t> woken(0);
+    Clock::time_point started;
+
+    thread sleeper([&]() {
+        unique_lock<mutex> lock(m);
+
+        while (true)
+        {
+            cond.wait(lock, [&]() { return signaled || exit; });
+            if (exit)
+            {
+                break;
+            }
+
+            started = Clock::now();
+            signaled = false;
+            woken.fetch_add(1, memory_order_release);
+        }
+    });
+
+    double totalNs = 0;
+    size_t expected = 0;
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        this_thread::sleep_for(SETTLE_TIME);
+        state.ResumeTiming();
+
+        Clock::time_point submitted = Clock::now();
+
+        {
+            lock_guard<mutex> lock(m);
+            signaled = true;
+        }
+        cond.notify_one();
+
+        waitFor(woken, ++expected);
+
+        totalNs += chrono::duration<double, nano>(started - submitted).count();
+    }
+
+    {
+        lock_guard<mutex> lock(m);
+        exit = true;
+    }
+    cond.notify_one();
+    sleeper.join();
+
+    state.counters["latency_ns"] = benchmark::Counter(totalNs, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_WakeLatencyCondvar)->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// Several producer threads submitting into the same pool
+// ----------------------------------------------------------------------------
+
+static unique_ptr<ThreadPool> sharedPool;
+static atomic<size_t>         sharedDone(0);
+
+static void BM_ProducerContention(benchmark::State & state)
+{
+    if (state.thread_index() == 0)
+    {
+        sharedPool.reset(new ThreadPool(state.range(0)));
+        sharedDone = 0;
+    }
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < BATCH_SIZE; i++)
+        {
+            sharedPool->addTask([]() { sharedDone.fetch_add(1, memory_order_release); });
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * BATCH_SIZE);
+
+    if (state.thread_index() == 0)
+    {
+        // Drain the backlog of all producers before the next run
+        sharedPool->stop(false);
+        sharedPool.reset();
+    }
+}
+BENCHMARK(BM_ProducerContention)->Apply(poolSizes)->ThreadRange(1, 8)->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// Producers submitting as fast as they can, each into its own queue, while the
+// workers keep draining. Compare builds with cacheline=64 (default) and
+// cacheline=8 to see the cost of false sharing in the pool's shared state.
+// ----------------------------------------------------------------------------
+
+static void BM_HighRateSubmission(benchmark::State & state)
+{
+    if (state.thread_index() == 0)
+    {
+        sharedPool.reset(new ThreadPool(state.range(0), state.threads()));
+    }
+
+    for (auto _ : state)
+    {
+        sharedPool->addTask([]() {});
+    }
+
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0)
+    {
+        sharedPool->stop(false);
+        sharedPool.reset();
+    }
+}
+BENCHMARK(BM_HighRateSubmission)->Arg(2)->Arg(4)->ThreadRange(1, 8)->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// Fan out a batch of tasks, then fan in by collecting all their futures
+// ----------------------------------------------------------------------------
+
+static void BM_FanOutFanIn(benchmark::State & state)
+{
+    ThreadPool tp(state.range(0));
+    vector<future<size_t>> futures;
+    futures.reserve(BATCH_SIZE);
+
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < BATCH_SIZE; i++)
+        {
+            futures.emplace_back(tp.addTask([](size_t x) { return x * x; }, i));
+        }
+
+        size_t sum = 0;
+        for (auto & f : futures)
+        {
+            sum += f.get();
+        }
+        benchmark::DoNotOptimize(sum);
+
+        futures.clear();
+    }
+
+    state.SetItemsProcessed(state.iterations() * BATCH_SIZE);
+}
+BENCHMARK(BM_FanOutFanIn)->Apply(poolSizes)->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// Handing a 10 MB buffer to a task and getting it back, should cost two moves
+// ----------------------------------------------------------------------------
+
+static void BM_LargeArgumentRoundTrip(benchmark::State & state)
+{
+    ThreadPool tp(state.range(0));
+    vector<char> buffer(10 * 1024 * 1024);
+
+    for (auto _ : state)
+    {
+        buffer = tp.addTask([](vector<char> v) { return v; }, std::move(buffer)).get();
+    }
+
+    benchmark::DoNotOptimize(buffer.data());
+}
+BENCHMARK(BM_LargeArgumentRoundTrip)->Apply(poolSizes)->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// The fill-array workload from the load tests, including pool setup/teardown
+// ----------------------------------------------------------------------------
+
+static void BM_FillArray(benchmark::State & state)
+{
+    size_t tasksCount = state.range(1);
+    vector<uint8_t> arr(tasksCount);
+    uint8_t * data = arr.data();
+
+    for (auto _ : state)
+    {
+        ThreadPool tp(state.range(0));
+
+        for (size_t i = 0; i < tasksCount; i++)
+        {
+            tp.addTask([data, i]() { data[i] = (uint8_t)i; });
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * tasksCount);
+}
+BENCHMARK(BM_FillArray)->ArgsProduct({ { 1, 2, 4, 8, 16 }, { 1000, 100000 } })->UseRealTime();
+
+// ----------------------------------------------------------------------------
+// Sorting 4M random integers: parallelSort across pool sizes, against
+// std::sort and, where the standard library has it, std::execution::par
+// ----------------------------------------------------------------------------
+
+static const size_t SORT_SIZE = 4 * 1024 * 1024;
+
+static vector<uint64_t> randomValues(size_t count)
+{
+    vector<uint64_t> values(count);
+    uint64_t seed = 88172645463325252ull;
+
+    for (uint64_t & value : values)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        value = seed;
+    }
+
+    return values;
+}
+
+template < class Sort >
+static void sortBenchmark(benchmark::State & state, Sort sort)
+{
+    const vector<uint64_t> input = randomValues(SORT_SIZE);
+    vector<uint64_t> values;
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        values = input;
+        state.ResumeTiming();
+
+        sort(values);
+        benchmark::DoNotOptimize(values.data());
+    }
+
+    state.SetItemsProcessed(state.iterations() * SORT_SIZE);
+}
+
+static void BM_ParallelSort(benchmark::State & state)
+{
+    ThreadPool tp(state.range(0));
+    sortBenchmark(state, [&tp](vector<uint64_t> & v) { parallelSort(tp, v.begin(), v.end()); });
+}
+BENCHMARK(BM_ParallelSort)->Apply(poolSizes)->UseRealTime();
+
+static void BM_StdSort(benchmark::State & state)
+{
+    sortBenchmark(state, [](vector<uint64_t> & v) { std::sort(v.begin(), v.end()); });
+}
+BENCHMARK(BM_StdSort)->UseRealTime();
+
+#ifdef BENCH_PARALLEL_STL
+static void BM_StdSortParallel(benchmark::State & state)
+{
+    sortBenchmark(state, [](vector<uint64_t> & v) { std::sort(std::execution::par, v.begin(), v.end()); });
+}
+BENCHMARK(BM_StdSortParallel)->UseRealTime();
+#endif
+
+BENCHMARK_MAIN();
@@ -0,0 +1,453 @@
+/*
+    Copyright 2016 Daniel Trugman
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef THREAD_POOL_PIPELINE_HPP
+#define THREAD_POOL_PIPELINE_HPP
+
+#include "ThreadPool.hpp"
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <system_error>
+#include <condition_variable>
+
+// ----------------------------------------------------------------------------
+// Pipeline module decleration
+// ----------------------------------------------------------------------------
+
+// Runs tokens read from a source through a chain of stages on a pool's
+// workers, like TBB's parallel_pipeline. At most 'tokens' tokens are in
+// flight at once, so the queues in front of the stages stay bounded: the
+// source isn't read again until a token leaves the last stage. Tokens are
+// reused, so the buffers they hold are only allocated once.
+template < class Token >
+class Pipeline
+{
+public:
+    enum class Mode
+    {
+        SERIAL_IN_ORDER,     // One token at a time, in the order they were read
+        SERIAL_OUT_OF_ORDER, // One token at a time, in any order
+        PARALLEL             // Any number of tokens at once
+    };
+
+    Pipeline(ThreadPool & pool, size_t tokens)
+        : _pool(pool), _reading(false), _done(true), _live(0), _read(0), _failed(false)
+    {
+        for (size_t i = 0; i < (tokens ? tokens : 1); i++)
+        {
+            _slots.emplace_back(new Slot());
+            _free.push_back(_slots.back().get());
+        }
+    }
+
+    Pipeline(const Pipeline &) = delete;
+    Pipeline & operator=(const Pipeline &) = delete;
+
+    // Stages run in the order they were added
+    Pipeline & addStage(Mode mode, std::function<void(Token &)> stage)
+    {
+        _stages.emplace_back(new Stage(mode, std::move(stage), _slots.size()));
+        return *this;
+    }
+
+    // Reads tokens with 'source', one at a time, until it returns false, and
+    // returns once all of them went through the stages. The first exception
+    // thrown by the source or a stage stops reading, the tokens in flight
+    // skip the stages left, and it's rethrown here. Stopping the pool
+    // immediately fails the run the same way with std::runtime_error, since
+    // the tokens queued on the pool are dropped. Called from one of the
+    // pool's tasks, the pool makes up for the waiting worker meanwhile.
+    // One run at a time.
+    void run(std::function<bool(Token &)> source)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+
+            _source = std::move(source);
+            _done = false;
+            _read = 0;
+            _failed = false;
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+            _error = nullptr;
+#endif
+        }
+
+        for (std::unique_ptr<Stage> & stage : _stages)
+        {
+            stage->next = 0;
+        }
+
+        read();
+
+        _pool.blocking([this]()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _finished.wait(lock, [this](){ return _done && _live == 0; });
+        });
+
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+        if (_error)
+        {
+            std::rethrow_exception(_error);
+        }
+#endif
+    }
+
+private:
+    struct Slot
+    {
+        Slot()
+            : seq(0)
+        {}
+
+        Token  token;
+        size_t seq; // Read order
+    };
+
+    // A serial stage handed over to a token, when tokens can't be posted
+    struct Handoff
+    {
+        Slot * slot;
+        size_t index;
+    };
+
+    // Takes a token on from the given stage, as a task on the pool
+    class Step
+    {
+    public:
+        Step(Pipeline & pipeline, Slot * slot, size_t index, bool owned)
+            : _pipeline(&pipeline), _slot(slot), _index(index), _owned(owned)
+        {}
+
+        Step(Step && other) noexcept
+            : _pipeline(other._pipeline), _slot(other._slot), _index(other._index), _owned(other._owned)
+        {
+            other._slot = nullptr;
+        }
+
+        Step(const Step &) = delete;
+        Step & operator=(const Step &) = delete;
+
+        // Never run, since the pool dropped it when stopping, unless it was
+        // rejected, which post() takes care of
+        ~Step()
+        {
+            if (_slot && _slot != posting())
+            {
+                _pipeline->abandon(_slot, _index, _owned);
+            }
+        }
+
+        void operator()() noexcept
+        {
+            Slot * slot = _slot;
+            _slot = nullptr;
+
+            _pipeline->advance(slot, _index, _owned);
+        }
+
+    private:
+        Pipeline * _pipeline;
+        Slot *     _slot;
+        size_t     _index;
+        bool       _owned;
+    };
+
+    struct Stage
+    {
+        Stage(Mode mode, std::function<void(Token &)> && func, size_t tokens)
+            : mode(mode), func(std::move(func)), busy(false), next(0), window(tokens, nullptr)
+        {}
+
+        Mode                         mode;
+        std::function<void(Token &)> func;
+
+        // Serial stages only
+        std::mutex                   mutex;
+        bool                         busy;
+        size_t                       next;    // In order: the token up next
+        std::vector<Slot *>          window;  // In order: tokens waiting, by read order modulo their count
+        std::deque<Slot *>           waiting; // Out of order: tokens waiting
+    };
+
+    // Reads tokens into the free slots, on one thread at a time. A token
+    // that left the last stage is freed in the same critical section that
+    // decides whether the run is over, since run() may return and destroy
+    // the pipeline as soon as the lock is released.
+    void read(Slot * left = nullptr)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        if (left)
+        {
+            _free.push_back(left);
+            _live--;
+        }
+
+        // The reader sees the slot, and only it sets '_done', so the run
+        // can't be over meanwhile
+        if (_reading)
+        {
+            return;
+        }
+
+        _reading = true;
+
+        while (!_done && !_free.empty())
+        {
+            Slot * slot = _free.back();
+            _free.pop_back();
+            _live++;
+
+            lock.unlock();
+
+            bool more = !_failed && pull(slot->token);
+
+            if (more)
+            {
+                slot->seq = _read++;
+                post(slot, 0, false);
+            }
+
+            lock.lock();
+
+            if (!more)
+            {
+                _done = true;
+                _free.push_back(slot);
+                _live--;
+            }
+        }
+
+        _reading = false;
+
+        // Notified under the lock, the waiter can't destroy the condition
+        // variable while it's being notified
+        if (_done && _live == 0)
+        {
+            _finished.notify_all();
+        }
+    }
+
+    bool pull(Token & token)
+    {
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+        try
+        {
+            return _source(token);
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+            return false;
+        }
+#else
+        return _source(token);
+#endif
+    }
+
+    // Takes the token from the given stage on. 'owned' when the serial stage
+    // was already handed to it by the previous token. Serial stages handed
+    // over are posted, or left in 'handoffs' when given.
+    void advance(Slot * slot, size_t index, bool owned, std::vector<Handoff> * handoffs = nullptr)
+    {
+        for (; index < _stages.size(); index++, owned = false)
+        {
+            Stage & stage = *_stages[index];
+
+            if (stage.mode == Mode::PARALLEL)
+            {
+                process(stage, slot->token);
+                continue;
+            }
+
+            // Queued, whoever holds the stage hands it over when done
+            if (!owned && !acquire(stage, slot))
+            {
+                return;
+            }
+
+            process(stage, slot->token);
+
+            if (Slot * next = release(stage))
+            {
+                if (handoffs)
+                {
+                    handoffs->push_back(Handoff{ next, index });
+                }
+                else
+                {
+                    post(next, index, true);
+                }
+            }
+        }
+
+        read(slot);
+    }
+
+    bool acquire(Stage & stage, Slot * slot)
+    {
+        std::lock_guard<std::mutex> guard(stage.mutex);
+
+        if (stage.mode == Mode::SERIAL_IN_ORDER)
+        {
+            // Tokens not past this stage yet are never more than the slots
+            if (stage.busy || slot->seq != stage.next)
+            {
+                stage.window[slot->seq % stage.window.size()] = slot;
+                return false;
+            }
+        }
+        else if (stage.busy)
+        {
+            stage.waiting.push_back(slot);
+            return false;
+        }
+
+        stage.busy = true;
+        return true;
+    }
+
+    // Returns the token to run next, if any, which the stage stays busy for
+    Slot * release(Stage & stage)
+    {
+        std::lock_guard<std::mutex> guard(stage.mutex);
+
+        Slot * next = nullptr;
+
+        if (stage.mode == Mode::SERIAL_IN_ORDER)
+        {
+            stage.next++;
+            std::swap(next, stage.window[stage.next % stage.window.size()]);
+        }
+        else if (!stage.waiting.empty())
+        {
+            next = stage.waiting.front();
+            stage.waiting.pop_front();
+        }
+
+        stage.busy = next != nullptr;
+        return next;
+    }
+
+    void process(Stage & stage, Token & token)
+    {
+        if (_failed)
+        {
+            return;
+        }
+
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+        try
+        {
+            stage.func(token);
+        }
+        catch (...)
+        {
+            fail(std::current_exception());
+        }
+#else
+        stage.func(token);
+#endif
+    }
+
+    // Runs the rest of the token's way on a worker, or right here if the
+    // pool stopped meanwhile
+    void post(Slot * slot, size_t index, bool owned)
+    {
+        std::error_code ec;
+
+        posting() = slot;
+        _pool.tryAddTask(ec, Step(*this, slot, index, owned));
+        posting() = nullptr;
+
+        if (ec)
+        {
+            advance(slot, index, owned);
+        }
+    }
+
+    // The token this thread is posting, if any
+    static Slot *& posting()
+    {
+        static thread_local Slot * slot = nullptr;
+        return slot;
+    }
+
+    // Fails the run for a token dropped by the pool, and takes it through
+    // the stages left without running them. The pool is dropping its tasks
+    // meanwhile, so nothing is posted: the tokens handed a serial stage go
+    // the same way, right here.
+    void abandon(Slot * slot, size_t index, bool owned)
+    {
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+        fail(std::make_exception_ptr(std::runtime_error("Pipeline's pool stopped")));
+#else
+        _failed = true;
+#endif
+
+        std::vector<Handoff> handoffs;
+        advance(slot, index, owned, &handoffs);
+
+        while (!handoffs.empty())
+        {
+            Handoff handoff = handoffs.back();
+            handoffs.pop_back();
+
+            advance(handoff.slot, handoff.index, true, &handoffs);
+        }
+    }
+
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+    void fail(std::exception_ptr error)
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+
+        if (!_error)
+        {
+            _error = error;
+        }
+
+        _failed = true;
+    }
+#endif
+
+    ThreadPool &                        _pool;
+    std::vector<std::unique_ptr<Stage>> _stages;
+    std::vector<std::unique_ptr<Slot>>  _slots;
+    std::function<bool(Token &)>        _source;
+
+    std::mutex                          _mutex;
+    std::condition_variable             _finished;
+    std::vector<Slot *>                 _free;
+    bool                                _reading;
+    bool                                _done;
+    size_t                              _live;    // Tokens read and not done yet
+    size_t                              _read;    // Only written by the reader
+    std::atomic<bool>                   _failed;
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+    std::exception_ptr                  _error;
+#endif
+};
+
+#endif // THREAD_POOL_PIPELINE_HPP
@@ -16,12 +16,40 @@
 
 #include <sstream>
 #include <thread>
+#include <chrono>
 #include <functional>
 #include <cstring>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <array>
+#include <future>
+#include <system_error>
+#include <stdexcept>
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <map>
+#include <numeric>
+#include <iterator>
+
+#include <string>
 
 #include "catch.hpp"
 
 #include "ThreadPool.hpp"
+#include "Pipeline.hpp"
+#include "Algorithms.hpp"
+
+#ifdef THREAD_POOL_HAS_IO_URING
+#include <cstdlib>
+#include <unistd.h>
+#endif
+
+#ifdef THREAD_POOL_HAS_EVENTFD
+#include <poll.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -132,7 +160,7 @@ TEST_CASE("Graceful/Immediate stop tests", "[algorithm]")
     // Use smallets pool size in order for the workers not to finish the job
     // before the stop/d'tor is called
 
-    uint8_t arr[10000];
+    uint8_t arr[10000] = {};
 
     size_t workersCount = SMALL_POOL_SIZE;
 
@@ -164,6 +192,9 @@ TEST_CASE("Graceful/Immediate stop tests", "[algorithm]")
     {
         ThreadPool tp(workersCount);
 
+        // Otherwise the workers may keep up with the tasks as they're added
+        tp.pause();
+
         addFillArrayTasks(tp, arr, sizeof(arr));
 
         tp.stop(true);
@@ -171,3 +202,1806 @@ TEST_CASE("Graceful/Immediate stop tests", "[algorithm]")
         REQUIRE(!arrayFull(arr, sizeof(arr)));
     }
 }
+
+TEST_CASE("Tracing tests", "[trace]")
+{
+    ThreadPool tp(SMALL_POOL_SIZE);
+
+    SECTION("No events unless enabled")
+    {
+        tp.addTask([]() {}).get();
+
+        std::stringstream ss;
+        tp.dumpTrace(ss);
+
+        REQUIRE(ss.str().find("\"ph\":\"X\"") == std::string::npos);
+    }
+
+    SECTION("Events are recorded per category")
+    {
+        tp.enableTracing();
+
+        tp.addTask([]() {}).get();
+        tp.addCategorizedTask("io", []() {}).get();
+
+        tp.stop(false);
+
+        std::stringstream ss;
+        tp.dumpTrace(ss);
+        std::string trace = ss.str();
+
+        REQUIRE(trace.find("{\"traceEvents\":[") == 0);
+        REQUIRE(trace.find("\"cat\":\"task\"") != std::string::npos);
+        REQUIRE(trace.find("\"cat\":\"io\"") != std::string::npos);
+    }
+
+    SECTION("Ring buffer keeps the latest events")
+    {
+        tp.enableTracing(1);
+
+        tp.addCategorizedTask("first", []() {}).get();
+        tp.addCategorizedTask("second", []() {}).get();
+
+        tp.stop(false);
+
+        std::stringstream ss;
+        tp.dumpTrace(ss);
+
+        REQUIRE(ss.str().find("\"cat\":\"second\"") != std::string::npos);
+    }
+}
+
+TEST_CASE("Submission queues tests", "[queues]")
+{
+    const size_t PRODUCERS = 4;
+    const size_t TASKS = 1000;
+
+    std::atomic<size_t> done(0);
+
+    auto produce = [&done, PRODUCERS, TASKS](ThreadPool & tp)
+    {
+        std::vector<std::thread> producers;
+
+        for (size_t p = 0; p < PRODUCERS; p++)
+        {
+            producers.emplace_back([&tp, &done, TASKS]()
+            {
+                for (size_t i = 0; i < TASKS; i++)
+                {
+                    tp.addTask([&done]() { done++; });
+                }
+            });
+        }
+
+        for (std::thread & t : producers)
+        {
+            t.join();
+        }
+
+        tp.stop(false);
+    };
+
+    SECTION("Single queue")
+    {
+        ThreadPool tp(REGULAR_POOL_SIZE, 1);
+        produce(tp);
+        REQUIRE(done == PRODUCERS * TASKS);
+    }
+
+    SECTION("Queue per worker")
+    {
+        ThreadPool tp(REGULAR_POOL_SIZE);
+        produce(tp);
+        REQUIRE(done == PRODUCERS * TASKS);
+    }
+
+    SECTION("More queues than workers")
+    {
+        ThreadPool tp(SMALL_POOL_SIZE, LARGE_POOL_SIZE);
+        produce(tp);
+        REQUIRE(done == PRODUCERS * TASKS);
+    }
+}
+
+TEST_CASE("Worker local queue tests", "[local]")
+{
+    ThreadPool tp(SMALL_POOL_SIZE);
+
+    SECTION("Subtasks beyond the local capacity")
+    {
+        const size_t SUBTASKS = 10000;
+        std::atomic<size_t> done(0);
+
+        tp.addTask([&tp, &done, SUBTASKS]()
+        {
+            for (size_t i = 0; i < SUBTASKS; i++)
+            {
+                tp.addTask([&done]() { done++; });
+            }
+        }).get();
+
+        tp.stop(false);
+
+        REQUIRE(done == SUBTASKS);
+    }
+
+    SECTION("Waiting on a subtask doesn't deadlock")
+    {
+        int result = tp.addTask([&tp]()
+        {
+            return tp.addTask([]() { return 42; }).get();
+        }).get();
+
+        REQUIRE(result == 42);
+    }
+
+    SECTION("Nested pools use their own queues")
+    {
+        ThreadPool other(SMALL_POOL_SIZE);
+
+        int result = tp.addTask([&other]()
+        {
+            return other.addTask([]() { return 42; }).get();
+        }).get();
+
+        REQUIRE(result == 42);
+    }
+}
+
+TEST_CASE("Idle workers tests", "[wake]")
+{
+    ThreadPool tp(REGULAR_POOL_SIZE);
+
+    SECTION("The most recently idled worker is woken first")
+    {
+        std::map<uint64_t, size_t> tids;
+
+        // A worker still starting up may take the first task
+        tp.addTask([]() {}).get();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        for (size_t i = 0; i < 20; i++)
+        {
+            tids[tp.addTask(getTid).get()]++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+
+        // The worker that just finished may not have gone back to sleep yet
+        // on a loaded machine, so some of the tasks go to another one
+        size_t most = 0;
+
+        for (const std::pair<const uint64_t, size_t> & tid : tids)
+        {
+            most = std::max(most, tid.second);
+        }
+
+        REQUIRE(most >= 15);
+    }
+
+    SECTION("Every idle worker gets woken")
+    {
+        for (size_t round = 0; round < 3; round++)
+        {
+            std::atomic<size_t> started(0);
+            std::vector<std::future<bool>> futures;
+
+            // Each task waits for all the others to start
+            for (size_t i = 0; i < REGULAR_POOL_SIZE; i++)
+            {
+                futures.emplace_back(tp.addTask([&started]() {
+                    started++;
+
+                    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+                    while (started < REGULAR_POOL_SIZE && std::chrono::steady_clock::now() < deadline)
+                    {
+                        std::this_thread::yield();
+                    }
+
+                    return started == REGULAR_POOL_SIZE;
+                }));
+            }
+
+            for (auto & future : futures)
+            {
+                REQUIRE(future.get());
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+}
+
+TEST_CASE("Worker affinity tests", "[affinity]")
+{
+    ThreadPool tp(REGULAR_POOL_SIZE);
+
+    SECTION("Pinned tasks run on their worker")
+    {
+        std::set<uint64_t> workers;
+
+        for (size_t worker = 0; worker < REGULAR_POOL_SIZE; worker++)
+        {
+            std::set<uint64_t> tids;
+
+            for (size_t i = 0; i < 20; i++)
+            {
+                tids.insert(tp.addTaskOn(worker, getTid).get());
+            }
+
+            REQUIRE(tids.size() == 1);
+            workers.insert(*tids.begin());
+        }
+
+        REQUIRE(workers.size() == REGULAR_POOL_SIZE);
+    }
+
+    SECTION("Worker ids wrap around the pool size")
+    {
+        REQUIRE(tp.addTaskOn(REGULAR_POOL_SIZE, getTid).get() == tp.addTaskOn(0, getTid).get());
+        REQUIRE(tp.addTaskOn(2 * REGULAR_POOL_SIZE + 1, getTid).get() == tp.addTaskOn(1, getTid).get());
+
+        // Preferred tasks may be stolen, so only check they're taken in
+        REQUIRE(tp.addTaskNear(REGULAR_POOL_SIZE + 1, []() { return 42; }).get() == 42);
+        REQUIRE(tp.addTaskNear(static_cast<size_t>(-1), []() { return 42; }).get() == 42);
+    }
+
+    SECTION("Pinned tasks wait for their worker")
+    {
+        std::atomic<bool> release(false);
+
+        auto busy = tp.addTaskOn(0, [&release]() {
+            while (!release)
+            {
+                std::this_thread::yield();
+            }
+            return getTid();
+        });
+
+        auto pinned = tp.addTaskOn(0, getTid);
+
+        REQUIRE(pinned.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout);
+
+        release = true;
+        REQUIRE(pinned.get() == busy.get());
+    }
+
+    SECTION("Preferred tasks are stolen from a busy worker")
+    {
+        std::atomic<bool> release(false);
+
+        auto busy = tp.addTaskOn(0, [&release]() {
+            while (!release)
+            {
+                std::this_thread::yield();
+            }
+            return getTid();
+        });
+
+        auto preferred = tp.addTaskNear(0, getTid);
+
+        REQUIRE(preferred.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+
+        release = true;
+        REQUIRE(preferred.get() != busy.get());
+    }
+
+    SECTION("Pinned tasks run on workers parked by auto-tuning")
+    {
+        tp.enableAutoTuning(1, 1, std::chrono::milliseconds(1));
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (tp.stats().active > 1 && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        REQUIRE(tp.addTaskOn(REGULAR_POOL_SIZE - 1, []() { return 42; }).get() == 42);
+
+        tp.stop(false);
+    }
+
+    SECTION("Queued tasks are drained or dropped when stopping")
+    {
+        std::atomic<size_t> done(0);
+
+        tp.pause();
+
+        for (size_t i = 0; i < 10; i++)
+        {
+            tp.addTaskOn(i, [&done]() { done++; });
+            tp.addTaskNear(i, [&done]() { done++; });
+        }
+
+        tp.stop(false);
+        REQUIRE(done == 20);
+
+        tp.start();
+        tp.pause();
+
+        auto pinned = tp.addTaskOn(1, []() {});
+        auto preferred = tp.addTaskNear(1, []() {});
+
+        tp.stop(true);
+
+        REQUIRE_THROWS(pinned.get());
+        REQUIRE_THROWS(preferred.get());
+        REQUIRE_THROWS(tp.addTaskOn(0, []() {}));
+    }
+}
+
+TEST_CASE("Strand tests", "[strand]")
+{
+    ThreadPool tp(REGULAR_POOL_SIZE);
+
+    SECTION("Tasks run in order, one at a time")
+    {
+        const size_t STRANDS = 4;
+        const size_t TASKS = 2000;
+
+        std::vector<ThreadPool::Strand> strands;
+        std::vector<std::vector<size_t>> order(STRANDS);
+        std::vector<std::atomic<int>> inside(STRANDS);
+        std::atomic<bool> overlapped(false);
+
+        for (size_t s = 0; s < STRANDS; s++)
+        {
+            strands.push_back(tp.makeStrand());
+            inside[s] = 0;
+        }
+
+        for (size_t i = 0; i < TASKS; i++)
+        {
+            for (size_t s = 0; s < STRANDS; s++)
+            {
+                strands[s].addTask([&, s, i]() {
+                    if (inside[s]++ != 0)
+                    {
+                        overlapped = true;
+                    }
+                    order[s].push_back(i);
+                    inside[s]--;
+                });
+            }
+        }
+
+        tp.waitIdle();
+
+        REQUIRE(!overlapped);
+        for (size_t s = 0; s < STRANDS; s++)
+        {
+            REQUIRE(order[s].size() == TASKS);
+            REQUIRE(std::is_sorted(order[s].begin(), order[s].end()));
+        }
+    }
+
+    SECTION("Different strands run in parallel")
+    {
+        ThreadPool::Strand first = tp.makeStrand();
+        ThreadPool::Strand second = tp.makeStrand();
+
+        std::atomic<bool> started(false);
+
+        auto waiting = first.addTask([&started]() {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+            while (!started && std::chrono::steady_clock::now() < deadline)
+            {
+                std::this_thread::yield();
+            }
+            return started.load();
+        });
+
+        second.addTask([&started]() { started = true; });
+
+        REQUIRE(waiting.get());
+    }
+
+    SECTION("Tasks left after a full batch still run")
+    {
+        ThreadPool::Strand strand = tp.makeStrand();
+        std::atomic<size_t> done(0);
+
+        // The first drain runs a batch of 64, leaving just the last one
+        tp.pause();
+        for (size_t i = 0; i < 65; i++)
+        {
+            strand.addTask([&done]() { done++; });
+        }
+        tp.resume();
+
+        tp.waitIdle();
+        REQUIRE(done == 65);
+    }
+
+    SECTION("Tasks added from the strand run after the current one")
+    {
+        ThreadPool::Strand strand = tp.makeStrand();
+        std::vector<int> order;
+
+        strand.addTask([&strand, &order]() {
+            strand.addTask([&order]() { order.push_back(2); });
+            order.push_back(1);
+        }).get();
+
+        strand.addTask([]() {}).get();
+
+        REQUIRE(order == std::vector<int>({ 1, 2 }));
+    }
+
+    SECTION("Tasks outlive the strand's handle")
+    {
+        std::atomic<size_t> done(0);
+
+        {
+            ThreadPool::Strand strand = tp.makeStrand();
+            for (size_t i = 0; i < 100; i++)
+            {
+                strand.addTask([&done]() { done++; });
+            }
+        }
+
+        tp.waitIdle();
+        REQUIRE(done == 100);
+    }
+
+    SECTION("Stopping drains or drops the strand's tasks")
+    {
+        ThreadPool::Strand strand = tp.makeStrand();
+        std::atomic<size_t> done(0);
+
+        tp.pause();
+        for (size_t i = 0; i < 100; i++)
+        {
+            strand.addTask([&done]() { done++; });
+        }
+
+        tp.stop(false);
+        REQUIRE(done == 100);
+        REQUIRE_THROWS(strand.addTask([]() {}));
+
+        tp.start();
+        tp.pause();
+        auto dropped = strand.addTask([]() {});
+
+        tp.stop(true);
+        REQUIRE_THROWS(dropped.get());
+
+        tp.start();
+        REQUIRE(strand.addTask([]() { return 42; }).get() == 42);
+    }
+
+    SECTION("Tasks added while stopping never hang")
+    {
+        size_t hanging = 0;
+
+        for (size_t round = 0; round < 50; round++)
+        {
+            ThreadPool pool(SMALL_POOL_SIZE);
+            ThreadPool::Strand strand = pool.makeStrand();
+            std::vector<std::future<void>> futures;
+
+            std::thread producer([&strand, &futures]() {
+                std::error_code ec;
+
+                while (!ec)
+                {
+                    futures.push_back(strand.tryAddTask(ec, []() {}));
+                }
+
+                futures.pop_back();
+            });
+
+            std::this_thread::sleep_for(std::chrono::microseconds(100 * (round % 10)));
+            pool.stop(round % 2 == 0);
+            producer.join();
+
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+            for (std::future<void> & future : futures)
+            {
+                if (future.wait_until(deadline) != std::future_status::ready)
+                {
+                    hanging++;
+                }
+            }
+        }
+
+        REQUIRE(hanging == 0);
+    }
+}
+
+TEST_CASE("Pipeline tests", "[pipeline]")
+{
+    ThreadPool tp(REGULAR_POOL_SIZE);
+
+    struct Item
+    {
+        size_t value;
+        size_t squared;
+    };
+
+    const size_t TOKENS = 4;
+    const size_t ITEMS = 1000;
+
+    SECTION("Tokens go through every stage, serial ones one at a time")
+    {
+        Pipeline<Item> pipeline(tp, TOKENS);
+
+        std::vector<size_t> written;
+        std::atomic<int> inside(0);
+        std::atomic<bool> overlapped(false);
+        size_t unordered = 0;
+
+        pipeline.addStage(Pipeline<Item>::Mode::PARALLEL, [](Item & item) {
+            item.squared = item.value * item.value;
+        });
+        pipeline.addStage(Pipeline<Item>::Mode::SERIAL_OUT_OF_ORDER, [&](Item &) {
+            if (inside++ != 0)
+            {
+                overlapped = true;
+            }
+            unordered++;
+            inside--;
+        });
+        pipeline.addStage(Pipeline<Item>::Mode::SERIAL_IN_ORDER, [&written](Item & item) {
+            if (item.squared == item.value * item.value)
+            {
+                written.push_back(item.value);
+            }
+        });
+
+        size_t next = 0;
+        pipeline.run([&next, ITEMS](Item & item) {
+            item.value = next;
+            return next++ < ITEMS;
+        });
+
+        REQUIRE(!overlapped);
+        REQUIRE(unordered == ITEMS);
+        REQUIRE(written.size() == ITEMS);
+        REQUIRE(std::is_sorted(written.begin(), written.end()));
+    }
+
+    SECTION("No more tokens than requested are in flight")
+    {
+        Pipeline<Item> pipeline(tp, TOKENS);
+
+        std::atomic<size_t> live(0);
+        std::atomic<size_t> peak(0);
+
+        pipeline.addStage(Pipeline<Item>::Mode::PARALLEL, [](Item &) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        });
+        pipeline.addStage(Pipeline<Item>::Mode::SERIAL_IN_ORDER, [&live](Item &) {
+            live--;
+        });
+
+        size_t read = 0;
+        pipeline.run([&](Item &) {
+            size_t now = ++live;
+            peak = std::max(peak.load(), now);
+            return ++read <= 200;
+        });
+
+        REQUIRE(peak <= TOKENS + 1); // Counting the read that ends it
+        REQUIRE(live == 1);
+    }
+
+    SECTION("Exceptions stop the pipeline and are rethrown")
+    {
+        Pipeline<Item> pipeline(tp, TOKENS);
+
+        std::atomic<size_t> processed(0);
+
+        pipeline.addStage(Pipeline<Item>::Mode::PARALLEL, [](Item & item) {
+            if (item.value == 10)
+            {
+                throw std::logic_error("Bad item");
+            }
+        });
+        pipeline.addStage(Pipeline<Item>::Mode::SERIAL_IN_ORDER, [&processed](Item &) {
+            processed++;
+        });
+
+        size_t next = 0;
+        REQUIRE_THROWS(pipeline.run([&next](Item & item) { item.value = next++; return true; }));
+        REQUIRE(processed < next);
+
+        // Runs again afterwards
+        next = 0;
+        processed = 0;
+        pipeline.run([&next](Item & item) { item.value = 100 + next; return next++ < 50; });
+        REQUIRE(processed == 50);
+    }
+
+    SECTION("Running from one of the pool's tasks")
+    {
+        ThreadPool single(1);
+        Pipeline<Item> pipeline(single, TOKENS);
+
+        std::atomic<size_t> sum(0);
+        pipeline.addStage(Pipeline<Item>::Mode::SERIAL_IN_ORDER, [&sum](Item & item) {
+            sum += item.value;
+        });
+
+        single.addTask([&pipeline]() {
+            size_t next = 0;
+            pipeline.run([&next](Item & item) { item.value = next; return next++ < 100; });
+        }).get();
+
+        REQUIRE(sum == 99 * 100 / 2);
+    }
+
+    SECTION("Stopping the pool mid-run")
+    {
+        ThreadPool pool(SMALL_POOL_SIZE);
+        Pipeline<Item> pipeline(pool, 2 * TOKENS);
+
+        pipeline.addStage(Pipeline<Item>::Mode::PARALLEL, [](Item &) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }).addStage(Pipeline<Item>::Mode::SERIAL_IN_ORDER, [](Item &) {});
+
+        auto running = std::async(std::launch::async, [&pipeline]() {
+            size_t next = 0;
+
+            try
+            {
+                pipeline.run([&next](Item & item) { item.value = next; return next++ < 200; });
+            }
+            catch (const std::runtime_error &)
+            {
+                // The tokens dropped with the pool's tasks fail the run
+            }
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        pool.stop(true);
+
+        REQUIRE(running.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+    }
+
+    SECTION("Destroyed right after running")
+    {
+        size_t incomplete = 0;
+
+        for (size_t round = 0; round < 500; round++)
+        {
+            std::unique_ptr<Pipeline<Item>> pipeline(new Pipeline<Item>(tp, TOKENS));
+            std::atomic<size_t> processed(0);
+
+            pipeline->addStage(Pipeline<Item>::Mode::PARALLEL, [](Item & item) {
+                item.squared = item.value * item.value;
+            }).addStage(Pipeline<Item>::Mode::SERIAL_OUT_OF_ORDER, [&processed](Item &) {
+                processed++;
+            });
+
+            size_t next = 0;
+            pipeline->run([&next](Item & item) { item.value = next; return next++ < 2 * TOKENS; });
+
+            // On the heap, so sanitizers catch workers still using it
+            pipeline.reset();
+
+            if (processed != 2 * TOKENS)
+            {
+                incomplete++;
+            }
+        }
+
+        REQUIRE(incomplete == 0);
+    }
+}
+
+TEST_CASE("Parallel algorithms tests", "[algorithms]")
+{
+    ThreadPool tp(REGULAR_POOL_SIZE);
+
+    std::vector<int> values(200000);
+    uint32_t seed = 12345;
+    for (int & value : values)
+    {
+        seed = seed * 1103515245 + 12345;
+        value = static_cast<int>(seed >> 8);
+    }
+
+    SECTION("Sort")
+    {
+        std::vector<int> expected = values;
+        std::sort(expected.begin(), expected.end());
+
+        parallelSort(tp, values.begin(), values.end());
+        REQUIRE(values == expected);
+
+        // Sorted and reversed input
+        parallelSort(tp, values.begin(), values.end(), std::greater<int>());
+        REQUIRE(std::is_sorted(values.begin(), values.end(), std::greater<int>()));
+
+        parallelSort(tp, values.begin(), values.end());
+        REQUIRE(values == expected);
+    }
+
+    SECTION("Sort with many duplicates")
+    {
+        for (int & value : values)
+        {
+            value %= 3;
+        }
+
+        parallelSort(tp, values.begin(), values.end());
+        REQUIRE(std::is_sorted(values.begin(), values.end()));
+        REQUIRE(std::count(values.begin(), values.end(), 1) > 0);
+    }
+
+    SECTION("Sort short ranges")
+    {
+        std::vector<int> empty;
+        parallelSort(tp, empty.begin(), empty.end());
+
+        std::vector<int> small(values.begin(), values.begin() + 100);
+        parallelSort(tp, small.begin(), small.end());
+        REQUIRE(std::is_sorted(small.begin(), small.end()));
+    }
+
+    SECTION("Sort move-only elements")
+    {
+        std::vector<std::unique_ptr<int>> pointers;
+        for (int value : values)
+        {
+            pointers.emplace_back(new int(value));
+        }
+
+        parallelSort(tp, pointers.begin(), pointers.end(),
+                     [](const std::unique_ptr<int> & a, const std::unique_ptr<int> & b) { return *a < *b; });
+
+        REQUIRE(pointers.size() == values.size());
+        REQUIRE(std::is_sorted(pointers.begin(), pointers.end(),
+                               [](const std::unique_ptr<int> & a, const std::unique_ptr<int> & b) { return *a < *b; }));
+    }
+
+    SECTION("Inclusive and exclusive scans")
+    {
+        std::vector<int64_t> input(values.begin(), values.end());
+        std::vector<int64_t> expected(input.size());
+        std::vector<int64_t> output(input.size());
+
+        std::partial_sum(input.begin(), input.end(), expected.begin());
+        REQUIRE(parallelInclusiveScan(tp, input.begin(), input.end(), output.begin()) == output.end());
+        REQUIRE(output == expected);
+
+        // Shifted by one, starting from the initial value
+        expected.insert(expected.begin(), 0);
+        expected.pop_back();
+        for (int64_t & value : expected)
+        {
+            value += 7;
+        }
+
+        parallelExclusiveScan(tp, input.begin(), input.end(), output.begin(), int64_t(7));
+        REQUIRE(output == expected);
+
+        // In place
+        parallelExclusiveScan(tp, input.begin(), input.end(), input.begin(), int64_t(7));
+        REQUIRE(input == expected);
+
+        std::vector<int64_t> small(100, 1);
+        parallelInclusiveScan(tp, small.begin(), small.end(), small.begin());
+        REQUIRE(small.back() == 100);
+    }
+
+    SECTION("Scans keep the order of non-commutative operations")
+    {
+        // Composing x -> a * x + b functions, applied left to right
+        typedef std::pair<uint32_t, uint32_t> Affine;
+        auto compose = [](const Affine & f, const Affine & g) {
+            return Affine(g.first * f.first, g.first * f.second + g.second);
+        };
+
+        std::vector<Affine> functions;
+        for (int value : values)
+        {
+            functions.emplace_back(static_cast<uint32_t>(value) | 1, static_cast<uint32_t>(value) >> 3);
+        }
+
+        std::vector<Affine> expected(functions.size());
+        std::vector<Affine> output(functions.size());
+
+        std::partial_sum(functions.begin(), functions.end(), expected.begin(), compose);
+        parallelInclusiveScan(tp, functions.begin(), functions.end(), output.begin(), compose);
+        REQUIRE(output == expected);
+
+        expected.insert(expected.begin(), Affine(1, 0));
+        expected.pop_back();
+
+        parallelExclusiveScan(tp, functions.begin(), functions.end(), output.begin(), Affine(1, 0), compose);
+        REQUIRE(output == expected);
+    }
+
+    SECTION("Copy if")
+    {
+        auto even = [](int value) { return value % 2 == 0; };
+
+        std::vector<int> expected;
+        std::copy_if(values.begin(), values.end(), std::back_inserter(expected), even);
+
+        std::vector<int> output(values.size());
+        auto end = parallelCopyIf(tp, values.begin(), values.end(), output.begin(), even);
+
+        output.erase(end, output.end());
+        REQUIRE(output == expected);
+    }
+
+    SECTION("Partition")
+    {
+        auto even = [](int value) { return value % 2 == 0; };
+
+        std::vector<int> expected = values;
+        auto expectedMiddle = std::stable_partition(expected.begin(), expected.end(), even);
+
+        auto middle = parallelPartition(tp, values.begin(), values.end(), even);
+
+        REQUIRE(middle - values.begin() == expectedMiddle - expected.begin());
+        REQUIRE(values == expected);
+
+        std::vector<std::unique_ptr<int>> pointers;
+        for (int i = 0; i < 100000; i++)
+        {
+            pointers.emplace_back(new int(i));
+        }
+
+        auto split = parallelPartition(tp, pointers.begin(), pointers.end(),
+                                       [](const std::unique_ptr<int> & p) { return *p % 3 == 0; });
+
+        REQUIRE(split - pointers.begin() == 33334);
+        REQUIRE(std::is_sorted(pointers.begin(), split,
+                               [](const std::unique_ptr<int> & a, const std::unique_ptr<int> & b) { return *a < *b; }));
+    }
+
+    SECTION("Sort from one of the pool's tasks")
+    {
+        ThreadPool single(1);
+
+        single.addTask([&single, &values]() {
+            parallelSort(single, values.begin(), values.end());
+        }).get();
+
+        REQUIRE(std::is_sorted(values.begin(), values.end()));
+    }
+}
+
+TEST_CASE("Cache line alignment tests", "[layout]")
+{
+    SECTION("Heap allocated pool is aligned")
+    {
+        std::unique_ptr<ThreadPool> tp(new ThreadPool(SMALL_POOL_SIZE));
+
+        REQUIRE(reinterpret_cast<uintptr_t>(tp.get()) % THREAD_POOL_CACHE_LINE_SIZE == 0);
+        REQUIRE(tp->addTask([]() { return 42; }).get() == 42);
+    }
+
+    SECTION("Placement new")
+    {
+        alignas(ThreadPool) unsigned char storage[sizeof(ThreadPool)];
+
+        ThreadPool * tp = new (storage) ThreadPool(SMALL_POOL_SIZE);
+
+        REQUIRE(static_cast<void *>(tp) == static_cast<void *>(storage));
+        REQUIRE(tp->addTask([]() { return 42; }).get() == 42);
+
+        tp->~ThreadPool();
+    }
+}
+
+#ifdef THREAD_POOL_HAS_PMR
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+    std::atomic<size_t> allocations{0};
+    std::atomic<size_t> outstanding{0};
+
+private:
+    void * do_allocate(size_t bytes, size_t align) override
+    {
+        allocations++;
+        outstanding++;
+        return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+
+    void do_deallocate(void * ptr, size_t bytes, size_t align) override
+    {
+        outstanding--;
+        std::pmr::new_delete_resource()->deallocate(ptr, bytes, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+#endif
+
+TEST_CASE("Task memory tests", "[memory]")
+{
+    SECTION("Futures outlive the pool")
+    {
+        std::future<int> small;
+        std::future<std::vector<int>> large;
+
+        {
+            ThreadPool tp(SMALL_POOL_SIZE);
+
+            small = tp.addTask([]() { return 42; });
+            large = tp.addTask([]() { return std::vector<int>(1000, 42); });
+        }
+
+        REQUIRE(small.get() == 42);
+        REQUIRE(large.get().size() == 1000);
+    }
+
+    SECTION("Tasks of every size")
+    {
+        ThreadPool tp(REGULAR_POOL_SIZE);
+
+        std::array<char, 16> tiny = {};
+        std::array<char, 500> medium = {};
+        std::array<char, 5000> huge = {};
+
+        for (size_t i = 0; i < 1000; i++)
+        {
+            tp.addTask([tiny]() { return tiny.size(); });
+            tp.addTask([medium]() { return medium.size(); });
+            tp.addTask([huge]() { return huge.size(); });
+        }
+
+        REQUIRE(tp.addTask([huge]() { return huge.size(); }).get() == huge.size());
+    }
+
+    SECTION("Blocks freed by other threads are reused")
+    {
+        ThreadPool tp(SMALL_POOL_SIZE);
+
+        bool same = true;
+
+        for (size_t i = 0; same && i < 100000; i++)
+        {
+            same = (tp.addTask([i]() { return i; }).get() == i);
+        }
+
+        REQUIRE(same);
+    }
+
+    SECTION("Dropped tasks break their promise")
+    {
+        std::future<int> result;
+
+        {
+            ThreadPool tp(0);
+            result = tp.addTask([]() { return 42; });
+        }
+
+        REQUIRE_THROWS(result.get());
+    }
+
+#ifdef THREAD_POOL_HAS_PMR
+    SECTION("Custom memory resource")
+    {
+        CountingResource resource;
+
+        {
+            ThreadPool tp(SMALL_POOL_SIZE, &resource);
+
+            REQUIRE(tp.addTask([]() { return 42; }).get() == 42);
+            REQUIRE(tp.addTask([&tp]() { return tp.addTask([]() { return 42; }).get(); }).get() == 42);
+        }
+
+        REQUIRE(resource.allocations > 0);
+        REQUIRE(resource.outstanding == 0);
+    }
+#endif
+}
+
+struct Accumulator
+{
+    int add(int x)
+    {
+        total += x;
+        return total;
+    }
+
+    int total;
+};
+
+TEST_CASE("Task arguments tests", "[arguments]")
+{
+    ThreadPool tp(SMALL_POOL_SIZE);
+
+    SECTION("Move-only arguments")
+    {
+        std::unique_ptr<int> value(new int(42));
+
+        int result = tp.addTask([](std::unique_ptr<int> ptr) { return *ptr; }, std::move(value)).get();
+
+        REQUIRE(result == 42);
+    }
+
+    SECTION("Move-only function")
+    {
+        std::packaged_task<int()> task([]() { return 42; });
+        std::future<int> inner = task.get_future();
+
+        tp.addTask(std::move(task)).get();
+
+        REQUIRE(inner.get() == 42);
+    }
+
+    SECTION("Large arguments are moved, not copied")
+    {
+        std::vector<char> buffer(10 * 1024 * 1024);
+        uintptr_t data = reinterpret_cast<uintptr_t>(buffer.data());
+
+        uintptr_t received = tp.addTask([](std::vector<char> v) { return reinterpret_cast<uintptr_t>(v.data()); },
+                                        std::move(buffer)).get();
+
+        REQUIRE(received == data);
+    }
+
+    SECTION("Arguments are copied once")
+    {
+        std::shared_ptr<int> value(new int(42));
+
+        tp.addTask([](std::shared_ptr<int>) {}, value).get();
+
+        REQUIRE(value.use_count() == 1);
+    }
+
+    SECTION("References through std::ref")
+    {
+        int value = 0;
+
+        tp.addTask([](int & x) { x = 42; }, std::ref(value)).get();
+
+        REQUIRE(value == 42);
+    }
+
+    SECTION("Member functions")
+    {
+        Accumulator acc = { 40 };
+
+        REQUIRE(tp.addTask(&Accumulator::add, &acc, 2).get() == 42);
+        REQUIRE(tp.addTask(&Accumulator::add, acc, 1).get() == 43);
+        REQUIRE(acc.total == 42);
+    }
+}
+
+struct ThrowingMove
+{
+    ThrowingMove()
+    {}
+
+    ThrowingMove(ThrowingMove &&)
+    {
+        throw std::runtime_error("moved");
+    }
+};
+
+TEST_CASE("Exception handling tests", "[exceptions]")
+{
+    ThreadPool tp(SMALL_POOL_SIZE);
+
+    SECTION("Noexcept tasks")
+    {
+        auto nothrow = [](int x) noexcept { return x * 2; };
+
+        REQUIRE(tp.addTask(nothrow, 21).get() == 42);
+    }
+
+    SECTION("Noexcept tasks whose result throws when moved")
+    {
+        auto future = tp.addTask([]() noexcept { return ThrowingMove(); });
+
+        REQUIRE_THROWS(future.get());
+    }
+
+    SECTION("Throwing tasks propagate through their future")
+    {
+        auto future = tp.addTask([]() -> int { throw std::logic_error("task failed"); });
+
+        REQUIRE_THROWS(future.get());
+    }
+
+    SECTION("Adding to a stopped pool")
+    {
+        tp.stop(false);
+
+        std::error_code ec;
+        auto future = tp.tryAddTask(ec, []() { return 1; });
+
+        REQUIRE(ec == std::errc::operation_not_permitted);
+        REQUIRE(!future.valid());
+        REQUIRE_THROWS(tp.addTask([]() { return 1; }));
+    }
+
+    SECTION("Successful submissions clear the error code")
+    {
+        std::error_code ec = std::make_error_code(std::errc::operation_not_permitted);
+        auto future = tp.tryAddTask(ec, []() { return 1; });
+
+        REQUIRE(!ec);
+        REQUIRE(future.get() == 1);
+    }
+}
+
+TEST_CASE("Wait for idle tests", "[idle]")
+{
+    ThreadPool tp(REGULAR_POOL_SIZE);
+
+    SECTION("Waiting for all tasks")
+    {
+        std::atomic<size_t> done(0);
+
+        for (size_t i = 0; i < 100; i++)
+        {
+            tp.addTask([&done]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                done++;
+            });
+        }
+
+        tp.waitIdle();
+
+        REQUIRE(done == 100);
+    }
+
+    SECTION("Waiting for subtasks")
+    {
+        std::atomic<size_t> done(0);
+
+        tp.addTask([&tp, &done]() {
+            for (size_t i = 0; i < 10; i++)
+            {
+                tp.addTask([&done]() { done++; });
+            }
+        });
+
+        tp.waitIdle();
+
+        REQUIRE(done == 10);
+    }
+
+    SECTION("Waiting on an idle pool")
+    {
+        tp.waitIdle();
+
+        REQUIRE(tp.waitIdleFor(std::chrono::milliseconds(0)));
+    }
+
+    SECTION("Waiting with a timeout")
+    {
+        auto future = tp.addTask([]() { std::this_thread::sleep_for(std::chrono::milliseconds(200)); });
+
+        REQUIRE(!tp.waitIdleFor(std::chrono::milliseconds(10)));
+        REQUIRE(tp.waitIdleFor(std::chrono::seconds(10)));
+    }
+
+    SECTION("Graceful stop within the timeout")
+    {
+        std::atomic<size_t> done(0);
+
+        for (size_t i = 0; i < 20; i++)
+        {
+            tp.addTask([&done]() { done++; });
+        }
+
+        REQUIRE(tp.stop(true, std::chrono::seconds(10)));
+        REQUIRE(done == 20);
+    }
+
+    SECTION("Graceful stop escalates after the timeout")
+    {
+        std::vector<std::future<void>> futures;
+
+        for (size_t i = 0; i < 10 * REGULAR_POOL_SIZE; i++)
+        {
+            futures.push_back(tp.addTask([]() { std::this_thread::sleep_for(std::chrono::milliseconds(100)); }));
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+        REQUIRE(!tp.stop(true, std::chrono::milliseconds(50)));
+        REQUIRE(std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(500));
+
+        size_t broken = 0;
+        for (std::future<void> & future : futures)
+        {
+            try
+            {
+                future.get();
+            }
+            catch (const std::future_error &)
+            {
+                broken++;
+            }
+        }
+
+        REQUIRE(broken > 0);
+        REQUIRE(tp.waitIdleFor(std::chrono::milliseconds(0)));
+    }
+}
+
+TEST_CASE("Pause and restart tests", "[pause]")
+{
+    ThreadPool tp(SMALL_POOL_SIZE);
+
+    SECTION("Paused pools accept but don't run tasks")
+    {
+        std::atomic<size_t> done(0);
+
+        tp.pause();
+
+        for (size_t i = 0; i < 100; i++)
+        {
+            tp.addTask([&done]() { done++; });
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        REQUIRE(done == 0);
+        REQUIRE(!tp.waitIdleFor(std::chrono::milliseconds(0)));
+
+        tp.resume();
+        tp.waitIdle();
+
+        REQUIRE(done == 100);
+    }
+
+    SECTION("Stopping a paused pool drains it")
+    {
+        std::atomic<size_t> done(0);
+
+        tp.pause();
+
+        for (size_t i = 0; i < 10; i++)
+        {
+            tp.addTask([&done]() { done++; });
+        }
+
+        tp.stop(false);
+
+        REQUIRE(done == 10);
+    }
+
+    SECTION("Restarting a stopped pool")
+    {
+        tp.stop(false);
+        REQUIRE_THROWS(tp.addTask([]() { return 1; }));
+
+        tp.start();
+        REQUIRE(tp.addTask([]() { return 1; }).get() == 1);
+
+        tp.stop(true);
+        tp.start();
+        tp.start();
+        REQUIRE(tp.addTask([]() { return 2; }).get() == 2);
+    }
+
+    SECTION("Restarted workers keep using their local queues")
+    {
+        tp.stop(false);
+        tp.start();
+
+        std::atomic<size_t> done(0);
+
+        tp.addTask([&tp, &done]() {
+            for (size_t i = 0; i < 100; i++)
+            {
+                tp.addTask([&done]() { done++; });
+            }
+        }).get();
+
+        tp.waitIdle();
+
+        REQUIRE(done == 100);
+    }
+}
+
+TEST_CASE("Executor tests", "[executor]")
+{
+    SECTION("Tasks and stats")
+    {
+        ThreadPool tp(SMALL_POOL_SIZE);
+        ThreadPool::Executor executor = tp.makeExecutor();
+
+        std::atomic<size_t> done(0);
+
+        for (size_t i = 0; i < 100; i++)
+        {
+            executor.addTask([&done]() { done++; });
+        }
+
+        REQUIRE(executor.addTask([](int x) { return x; }, 42).get() == 42);
+
+        tp.waitIdle();
+
+        ThreadPool::Executor::Stats stats = executor.stats();
+        REQUIRE(done == 100);
+        REQUIRE(stats.submitted == 101);
+        REQUIRE(stats.completed == 101);
+        REQUIRE(stats.queued == 0);
+        REQUIRE(stats.running == 0);
+    }
+
+    SECTION("Running tasks limit")
+    {
+        ThreadPool tp(REGULAR_POOL_SIZE);
+        ThreadPool::Executor executor = tp.makeExecutor(1, 2);
+
+        std::atomic<size_t> running(0);
+        std::atomic<size_t> peak(0);
+
+        for (size_t i = 0; i < 20; i++)
+        {
+            executor.addTask([&running, &peak]() {
+                size_t now = ++running;
+                size_t seen = peak;
+                while (now > seen && !peak.compare_exchange_weak(seen, now))
+                {}
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                running--;
+            });
+        }
+
+        // Other tasks keep flowing meanwhile
+        REQUIRE(tp.addTask([]() { return 1; }).get() == 1);
+
+        tp.waitIdle();
+
+        REQUIRE(peak <= 2);
+        REQUIRE(executor.stats().completed == 20);
+    }
+
+    SECTION("Weighted fair scheduling")
+    {
+        ThreadPool tp(1);
+        ThreadPool::Executor heavy = tp.makeExecutor(3);
+        ThreadPool::Executor light = tp.makeExecutor(1);
+
+        std::mutex mutex;
+        std::vector<char> order;
+
+        tp.pause();
+
+        for (size_t i = 0; i < 40; i++)
+        {
+            heavy.addTask([&mutex, &order]() { std::lock_guard<std::mutex> guard(mutex); order.push_back('h'); });
+            light.addTask([&mutex, &order]() { std::lock_guard<std::mutex> guard(mutex); order.push_back('l'); });
+        }
+
+        tp.resume();
+        tp.waitIdle();
+
+        REQUIRE(order.size() == 80);
+        REQUIRE(std::count(order.begin(), order.begin() + 40, 'h') == 30);
+    }
+
+    SECTION("Stopping drops queued tasks")
+    {
+        ThreadPool tp(1);
+        ThreadPool::Executor executor = tp.makeExecutor(1, 1);
+
+        tp.pause();
+        auto future = executor.addTask([]() { return 1; });
+        tp.stop(true);
+
+        REQUIRE_THROWS(future.get());
+        REQUIRE_THROWS(executor.addTask([]() { return 1; }));
+    }
+}
+
+TEST_CASE("Tenant tests", "[tenant]")
+{
+    SECTION("A flooding tenant doesn't starve the others")
+    {
+        ThreadPool tp(1);
+
+        std::mutex mutex;
+        std::vector<uint64_t> order;
+
+        tp.pause();
+
+        for (size_t i = 0; i < 100; i++)
+        {
+            tp.tenant(1).addTask([&mutex, &order]() { std::lock_guard<std::mutex> guard(mutex); order.push_back(1); });
+        }
+
+        for (size_t i = 0; i < 5; i++)
+        {
+            tp.tenant(2).addTask([&mutex, &order]() { std::lock_guard<std::mutex> guard(mutex); order.push_back(2); });
+        }
+
+        tp.resume();
+        tp.waitIdle();
+
+        REQUIRE(order.size() == 105);
+        REQUIRE(std::count(order.begin(), order.begin() + 10, 2) == 5);
+    }
+
+    SECTION("Tenants keep their queue and weight")
+    {
+        ThreadPool tp(SMALL_POOL_SIZE);
+
+        tp.tenant(7).setWeight(4);
+        tp.tenant(7).addTask([]() {});
+        tp.tenant(7).addTask([]() {});
+        tp.waitIdle();
+
+        ThreadPool::Executor::Stats stats = tp.tenant(7).stats();
+        REQUIRE(stats.weight == 4);
+        REQUIRE(stats.completed == 2);
+        REQUIRE(tp.tenant(8).stats().submitted == 0);
+    }
+}
+
+TEST_CASE("Auto-tuning tests", "[tuning]")
+{
+    ThreadPool tp(REGULAR_POOL_SIZE);
+
+    SECTION("Stats")
+    {
+        for (size_t i = 0; i < 10; i++)
+        {
+            tp.addTask([]() {});
+        }
+
+        tp.waitIdle();
+
+        ThreadPool::Stats stats = tp.stats();
+        REQUIRE(stats.workers == REGULAR_POOL_SIZE);
+        REQUIRE(stats.active == REGULAR_POOL_SIZE);
+        REQUIRE(stats.pending == 0);
+        REQUIRE(stats.completed == 10);
+    }
+
+    SECTION("Parks workers without a backlog and adds them back under load")
+    {
+        tp.enableAutoTuning(1, REGULAR_POOL_SIZE, std::chrono::milliseconds(5));
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (tp.stats().active > 1 && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+
+        REQUIRE(tp.stats().active == 1);
+
+        // Blocking tasks, more workers get more of them done
+        std::vector<std::future<void>> futures;
+        for (size_t i = 0; i < 200; i++)
+        {
+            futures.push_back(tp.addTask([]() { std::this_thread::sleep_for(std::chrono::milliseconds(2)); }));
+        }
+
+        size_t peak = 1;
+        while (tp.stats().pending > 0)
+        {
+            peak = std::max(peak, tp.stats().active);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        for (std::future<void> & future : futures)
+        {
+            future.get();
+        }
+
+        REQUIRE(peak > 1);
+        REQUIRE(tp.stats().adjustments > 0);
+
+        tp.disableAutoTuning();
+        REQUIRE(tp.stats().active == REGULAR_POOL_SIZE);
+    }
+
+    SECTION("Tasks still drain when stopping with parked workers")
+    {
+        tp.enableAutoTuning(1, 1, std::chrono::milliseconds(1));
+
+        std::atomic<size_t> done(0);
+        for (size_t i = 0; i < 100; i++)
+        {
+            tp.addTask([&done]() { done++; });
+        }
+
+        tp.stop(false);
+
+        REQUIRE(done == 100);
+    }
+}
+
+// Unlike thread ids, never reused by threads started later
+size_t threadSerial()
+{
+    static std::atomic<size_t> next(0);
+    static thread_local size_t serial = next++;
+
+    return serial;
+}
+
+TEST_CASE("Blocking tasks tests", "[blocking]")
+{
+    SECTION("Outside the pool it just runs")
+    {
+        ThreadPool tp(1);
+
+        REQUIRE(tp.blocking([]() { return 42; }) == 42);
+    }
+
+    SECTION("A blocked worker is made up for")
+    {
+        ThreadPool tp(1);
+
+        std::promise<void> gate;
+        std::shared_future<void> opened = gate.get_future().share();
+
+        auto blocked = tp.addTask([&tp, opened]() {
+            return tp.blocking([opened]() { opened.wait(); return 1; });
+        });
+
+        // Only runs if another thread takes over for the blocked worker
+        auto opener = tp.addTask([&gate]() { gate.set_value(); });
+
+        REQUIRE(opener.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+        REQUIRE(blocked.get() == 1);
+
+        tp.waitIdle();
+        REQUIRE(tp.stats().completed == 2);
+    }
+
+    SECTION("Parked workers are woken first")
+    {
+        ThreadPool tp(SMALL_POOL_SIZE);
+        tp.enableAutoTuning(1, 1, std::chrono::milliseconds(1));
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (tp.stats().active > 1 && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        std::promise<void> gate;
+        std::shared_future<void> opened = gate.get_future().share();
+
+        tp.addTask([&tp, opened]() { tp.blocking([opened]() { opened.wait(); }); });
+        auto opener = tp.addTask([&gate]() { gate.set_value(); });
+
+        REQUIRE(opener.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+    }
+
+    SECTION("Helpers are reused")
+    {
+        ThreadPool tp(1);
+        std::set<size_t> helpers;
+
+        for (size_t i = 0; i < 10; i++)
+        {
+            std::promise<void> gate;
+            std::shared_future<void> opened = gate.get_future().share();
+
+            auto blocked = tp.addTask([&tp, opened]() { tp.blocking([opened]() { opened.wait(); }); });
+            auto opener = tp.addTask([&gate]() { gate.set_value(); return threadSerial(); });
+
+            REQUIRE(opener.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+            helpers.insert(opener.get());
+            blocked.get();
+        }
+
+        REQUIRE(helpers.size() == 1);
+    }
+
+    SECTION("Stopping waits for helpers")
+    {
+        ThreadPool tp(1);
+        std::atomic<size_t> done(0);
+
+        tp.addTask([&tp, &done]() {
+            tp.blocking([]() { std::this_thread::sleep_for(std::chrono::milliseconds(20)); });
+        });
+
+        for (size_t i = 0; i < 100; i++)
+        {
+            tp.addTask([&done]() { done++; });
+        }
+
+        tp.stop(false);
+
+        REQUIRE(done == 100);
+    }
+}
+
+#ifdef THREAD_POOL_HAS_IO_URING
+TEST_CASE("Asynchronous I/O tests", "[io]")
+{
+    ThreadPool tp(SMALL_POOL_SIZE);
+
+    SECTION("Write then read a file")
+    {
+        char path[] = "/tmp/ThreadPoolTestXXXXXX";
+        int fd = ::mkstemp(path);
+        REQUIRE(fd >= 0);
+        ::unlink(path);
+
+        const char data[] = "hello io_uring";
+        REQUIRE(tp.writeAsync(fd, data, sizeof(data), 0).get() == static_cast<ssize_t>(sizeof(data)));
+
+        char buffer[sizeof(data)] = {};
+        auto length = tp.readAsync(fd, buffer, sizeof(buffer), 0, [&buffer](ssize_t result) {
+            return result > 0 ? std::string(buffer, result - 1) : std::string();
+        });
+
+        REQUIRE(length.get() == "hello io_uring");
+
+        ::close(fd);
+    }
+
+    SECTION("Errors are returned as -errno")
+    {
+        char buffer[16];
+
+        REQUIRE(tp.readAsync(-1, buffer, sizeof(buffer), 0).get() == -EBADF);
+    }
+
+    SECTION("Workers keep running tasks while reads are pending")
+    {
+        int fds[2];
+        REQUIRE(::pipe(fds) == 0);
+
+        char buffer[4] = {};
+        auto read = tp.readAsync(fds[0], buffer, sizeof(buffer), 0);
+
+        for (size_t i = 0; i < SMALL_POOL_SIZE * 2; i++)
+        {
+            REQUIRE(tp.addTask([]() { return 1; }).get() == 1);
+        }
+
+        REQUIRE(read.wait_for(std::chrono::milliseconds(10)) == std::future_status::timeout);
+        REQUIRE(::write(fds[1], "abc", 3) == 3);
+        REQUIRE(read.get() == 3);
+        REQUIRE(std::string(buffer) == "abc");
+
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+
+    SECTION("Stopping waits for the I/O in flight")
+    {
+        int fds[2];
+        REQUIRE(::pipe(fds) == 0);
+
+        char buffer[4] = {};
+        std::atomic<bool> continued(false);
+        auto read = tp.readAsync(fds[0], buffer, sizeof(buffer), 0, [&continued](ssize_t result) {
+            continued = true;
+            return result;
+        });
+
+        std::thread writer([&fds]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            REQUIRE(::write(fds[1], "x", 1) == 1);
+        });
+
+        tp.stop(false);
+        writer.join();
+
+        REQUIRE(continued);
+        REQUIRE(read.get() == 1);
+
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+}
+#endif
+
+#ifdef THREAD_POOL_HAS_EVENTFD
+static bool readable(int fd, int timeoutMs)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    return ::poll(&pfd, 1, timeoutMs) == 1;
+}
+
+TEST_CASE("Event loop integration tests", "[events]")
+{
+    ThreadPool tp(SMALL_POOL_SIZE);
+
+    SECTION("Completion fd is readable when tasks finish")
+    {
+        int fd = tp.completionFd();
+        REQUIRE(fd >= 0);
+        REQUIRE(tp.completionFd() == fd);
+        REQUIRE_FALSE(readable(fd, 0));
+
+        auto first = tp.addTask([]() { return 1; });
+        REQUIRE(readable(fd, 1000));
+
+        tp.acknowledgeCompletions();
+        REQUIRE(first.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+        REQUIRE_FALSE(readable(fd, 0));
+
+        auto second = tp.addTask([]() { return 2; });
+        REQUIRE(readable(fd, 1000));
+        REQUIRE(second.get() == 2);
+    }
+
+#ifdef THREAD_POOL_HAS_IO_URING
+    SECTION("Watched fds are handled by the workers")
+    {
+        int fds[2];
+        REQUIRE(::pipe(fds) == 0);
+
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::string received;
+
+        auto handler = [&](uint32_t events) {
+            char c = '?';
+            if (!(events & EPOLLIN) || ::read(fds[0], &c, 1) != 1)
+            {
+                c = '!';
+            }
+
+            std::lock_guard<std::mutex> guard(mutex);
+            received += c;
+            cond.notify_all();
+        };
+
+        REQUIRE_FALSE(tp.watch(fds[0], EPOLLIN, handler));
+
+        auto await = [&](size_t length) {
+            std::unique_lock<std::mutex> lock(mutex);
+            return cond.wait_for(lock, std::chrono::seconds(5),
+                                 [&]() { return received.size() >= length; });
+        };
+
+        // Re-armed after every event, alongside regular tasks
+        REQUIRE(::write(fds[1], "a", 1) == 1);
+        REQUIRE(await(1));
+        REQUIRE(tp.addTask([]() { return 1; }).get() == 1);
+        REQUIRE(::write(fds[1], "b", 1) == 1);
+        REQUIRE(await(2));
+
+        // Events aren't handled while stopped, but once started again
+        tp.stop(false);
+        REQUIRE(::write(fds[1], "c", 1) == 1);
+        tp.start();
+        REQUIRE(await(3));
+        REQUIRE(received == "abc");
+
+        REQUIRE_FALSE(tp.unwatch(fds[0]));
+        REQUIRE(tp.unwatch(fds[0]) == std::errc::no_such_file_or_directory);
+
+        REQUIRE(::write(fds[1], "d", 1) == 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        REQUIRE(received == "abc");
+
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+
+    SECTION("Watching an invalid fd fails")
+    {
+        REQUIRE(tp.watch(-1, EPOLLIN, [](uint32_t) {}) == std::errc::bad_file_descriptor);
+    }
+
+    SECTION("Pinned tasks wake a worker waiting for the ring")
+    {
+        ThreadPool single(1);
+
+        int fds[2];
+        REQUIRE(::pipe(fds) == 0);
+        REQUIRE_FALSE(single.watch(fds[0], EPOLLIN, [](uint32_t) {}));
+
+        // The only worker goes on to wait for the watched fd
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        auto pinned = single.addTaskOn(0, []() { return 42; });
+        REQUIRE(pinned.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+        REQUIRE(pinned.get() == 42);
+
+        REQUIRE_FALSE(single.unwatch(fds[0]));
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+#endif
+}
+#endif
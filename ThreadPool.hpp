@@ -17,158 +17,4097 @@
 #ifndef THREAD_POOL_HPP
 #define THREAD_POOL_HPP
 
+#include <algorithm>
 #include <deque>
+#include <list>
+#include <unordered_map>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <vector>
 #include <thread>
 #include <future>
+#include <tuple>
+#include <type_traits>
+#include <ostream>
 #include <stdexcept>
+#include <system_error>
 #include <functional>
 #include <condition_variable>
 
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define THREAD_POOL_HAS_PMR 1
+#endif
+#endif
+
+// Asynchronous I/O through io_uring on Linux, talking to the kernel directly
+// (no liburing needed). Define THREAD_POOL_NO_IO_URING to leave it out.
+#if defined(__linux__) && defined(__has_include) && !defined(THREAD_POOL_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <cerrno>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define THREAD_POOL_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
+// Event loop integration through eventfd and epoll, on Linux
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#define THREAD_POOL_HAS_EVENTFD 1
+#endif
+
+// Idle workers sleep on a futex each on Linux, or on std::atomic::wait with
+// C++20. Define THREAD_POOL_NO_FUTEX to use the portable fallbacks instead.
+#if defined(__linux__) && !defined(THREAD_POOL_NO_FUTEX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(SYS_futex)
+#define THREAD_POOL_HAS_FUTEX 1
+#endif
+#endif
+#if !defined(THREAD_POOL_HAS_FUTEX) && defined(__cpp_lib_atomic_wait)
+#define THREAD_POOL_HAS_ATOMIC_WAIT 1
+#endif
+
+// Exceptions can be turned off (e.g. -fno-exceptions), the pool then reports
+// errors through error codes and invalid futures only
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define THREAD_POOL_HAS_EXCEPTIONS 1
+#endif
+
+// std::invoke and std::invoke_result replace std::result_of, which is
+// deprecated in C++17 and removed in C++20
+#if defined(__cpp_lib_is_invocable)
+#define THREAD_POOL_HAS_INVOKE 1
+#endif
+
+// Size of the blocks cores exchange between caches. Shared state written by
+// different threads is kept this far apart to avoid false sharing.
+// GCC's hardware_destructive_interference_size follows -mtune, so it warns
+// when used in headers, where it would make the layout depend on flags.
+#ifndef THREAD_POOL_CACHE_LINE_SIZE
+#if defined(__cpp_lib_hardware_interference_size) && !defined(__GNUC__)
+#define THREAD_POOL_CACHE_LINE_SIZE std::hardware_destructive_interference_size
+#else
+#define THREAD_POOL_CACHE_LINE_SIZE 64
+#endif
+#endif
+
 // ----------------------------------------------------------------------------
 // Thread pool module decleration
 // ----------------------------------------------------------------------------
 
 class ThreadPool
 {
+    struct Flow;
+    struct StrandQueue;
+
+    // What a task returns, its function and arguments are decay copied and
+    // then passed as rvalues
+    template < class Func, class... Args >
+#ifdef THREAD_POOL_HAS_INVOKE
+    using TaskResult = std::invoke_result_t<std::decay_t<Func>, std::decay_t<Args>...>;
+#else
+    using TaskResult = typename std::result_of<typename std::decay<Func>::type(typename std::decay<Args>::type...)>::type;
+#endif
+
 public:
-    ThreadPool(size_t size)
+    static const size_t DEFAULT_TRACE_CAPACITY = 4096;
+    static const size_t DEFAULT_TUNING_INTERVAL_MS = 500;
+
+    // Tasks are spread over 'queues' submission queues, producers are mapped
+    // to a queue by their thread id. Zero means a queue per worker.
+    ThreadPool(size_t size, size_t queues = 0)
     {
-        try
+        create(size, queues, nullptr);
+    }
+
+#ifdef THREAD_POOL_HAS_PMR
+    // Same as above, but tasks and their futures' states are allocated from
+    // 'resource' instead of the pool's own heaps. The resource must be thread
+    // safe and outlive every future returned by the pool.
+    ThreadPool(size_t size, std::pmr::memory_resource * resource, size_t queues = 0)
+    {
+        create(size, queues, resource);
+    }
+#endif
+
+    virtual ~ThreadPool()
+    {
+        stop(false);
+
+#ifdef THREAD_POOL_HAS_EVENTFD
+        if (_shared.completions >= 0)
         {
-            _shared.run = true;
+            ::close(_shared.completions);
+        }
+#endif
+#ifdef THREAD_POOL_HAS_IO_URING
+        if (_shared.watches.epoll >= 0)
+        {
+            ::close(_shared.watches.epoll);
+        }
+#endif
+    }
 
-            for (size_t id = 0; id < size; id++)
-            {
-                _workers.emplace_back(worker, id, std::ref(_shared));
-            }
+
+    // The pool's state is cache line aligned, see CacheAligned
+    static void * operator new(size_t size)
+    {
+        return CacheAligned::operator new(size);
+    }
+
+    static void operator delete(void * ptr)
+    {
+        CacheAligned::operator delete(ptr);
+    }
+
+    // The above hide the global placement forms, the caller aligns the
+    // storage itself
+    static void * operator new(size_t, void * where) noexcept
+    {
+        return where;
+    }
+
+    static void operator delete(void *, void *) noexcept
+    {}
+
+    // Stops accepting tasks and joins the workers. Queued tasks are dropped
+    // when 'immediate', their futures reporting a broken promise, otherwise
+    // the workers finish them first.
+    void stop(bool immediate = true)
+    {
+        if (!close())
+        {
+            return;
+        }
+
+        if (immediate)
+        {
+            drop();
+        }
+
+        join();
+    }
+
+    // Same as above, but a graceful stop waits at most 'timeout' for the
+    // queued tasks to finish before dropping the rest. Tasks already running
+    // are always waited for. Returns whether every queued task finished.
+    template < class Rep, class Period >
+    bool stop(bool graceful, const std::chrono::duration<Rep, Period> & timeout)
+    {
+        if (!close())
+        {
+            return true;
         }
-        catch(std::exception & ex)
+
+        if (graceful)
         {
-            stop(true);
+            resume();
+        }
 
-            throw ex;
+        bool drained = graceful && waitIdleFor(timeout);
+
+        if (!drained)
+        {
+            drop();
         }
+
+        join();
+
+        return drained;
     }
 
-    virtual ~ThreadPool()
+    // Blocks until every task submitted so far has finished, including
+    // tasks those tasks submit. Must not be called from the pool's workers.
+    void waitIdle()
     {
-        stop(false);
+        std::unique_lock<std::mutex> lock(_shared.mutex);
+        WaiterGuard waiter(_shared);
+
+        _shared.drained.wait(lock, [this](){ return _shared.unfinished == 0; });
     }
 
-    void stop(bool immediate = true)
+    // Same as above, giving up after 'timeout'. Returns whether the pool is idle.
+    template < class Rep, class Period >
+    bool waitIdleFor(const std::chrono::duration<Rep, Period> & timeout)
+    {
+        std::unique_lock<std::mutex> lock(_shared.mutex);
+        WaiterGuard waiter(_shared);
+
+        return _shared.drained.wait_for(lock, timeout, [this](){ return _shared.unfinished == 0; });
+    }
+
+    // Starts a stopped pool again with the same number of workers. Its queues,
+    // heaps and trace buffers are kept. Must not race with stop().
+    void start()
     {
+        if (_shared.run)
+        {
+            return;
+        }
+
+        _workers.clear();
+
         {
             std::lock_guard<std::mutex> guard(_shared.mutex);
 
-            // Not running, do nothing
-            if (!_shared.run)
-            {
-                return;
-            }
+            _shared.paused = false;
+            _shared.exit = false;
+            _shared.run = true;
+        }
+
+#ifdef THREAD_POOL_HAS_IO_URING
+        // Watched fds' events are left alone while stopped
+        if (IoRing * ring = _shared.ring)
+        {
+            std::lock_guard<std::mutex> guard(_shared.watches.mutex);
 
-            if (immediate)
+            if (_shared.watches.count > 0 && !_shared.watches.armed)
             {
-                _shared.tasks.clear();
+                arm(_shared, *ring);
             }
+        }
+#endif
 
-            _shared.run = false;
-            _shared.cond.notify_all();
+        StopGuard guard(*this);
+
+        for (size_t id = 0; id < _shared.locals.size(); id++)
+        {
+            _workers.emplace_back(worker, id, std::ref(_shared));
         }
 
-        for (Worker & w : _workers)
+        guard.dismiss();
+    }
+
+    // Stops the workers from picking up tasks, while tasks can still be added.
+    // Tasks already running aren't waited for. Stopping the pool resumes it,
+    // and waiting for it to go idle while paused blocks until resumed.
+    void pause()
+    {
+        std::lock_guard<std::mutex> guard(_shared.mutex);
+
+        if (_shared.run)
         {
-            w.join();
+            _shared.paused = true;
         }
     }
 
+    void resume()
+    {
+        std::lock_guard<std::mutex> guard(_shared.mutex);
+
+        _shared.paused = false;
+        wakeAll(_shared);
+    }
+
+    // Throws std::runtime_error when the pool isn't running. When built
+    // without exceptions an invalid future is returned instead.
     template < class Func, class... Args >
     auto addTask(Func&& func, Args&&... args)
-        -> std::future<typename std::result_of<Func(Args...)>::type>
+        -> std::future<TaskResult<Func, Args...>>
+    {
+        return addCategorizedTask(DEFAULT_TRACE_CATEGORY,
+                                  std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // Same as addTask, but tags the task with a category that shows up in
+    // the trace. The category must outlive the pool (e.g. a string literal).
+    template < class Func, class... Args >
+    auto addCategorizedTask(const char * category, Func&& func, Args&&... args)
+        -> std::future<TaskResult<Func, Args...>>
     {
-        using result_type = typename std::result_of<Func(Args...)>::type;
+        std::error_code ec;
 
-        std::lock_guard<std::mutex> guard(_shared.mutex);
+        auto result = submit(ec, nullptr, category, std::forward<Func>(func), std::forward<Args>(args)...);
 
-        if (!_shared.run)
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+        if (ec)
         {
             throw std::runtime_error("Can't add tasks when not running");
         }
+#endif
+
+        return result;
+    }
+
+    // Same as addTask, but never throws for misuse. When the pool isn't
+    // running, 'ec' is set to operation_not_permitted and the returned
+    // future is invalid.
+    template < class Func, class... Args >
+    auto tryAddTask(std::error_code & ec, Func&& func, Args&&... args)
+        -> std::future<TaskResult<Func, Args...>>
+    {
+        return submit(ec, nullptr, DEFAULT_TRACE_CATEGORY, std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // Same as addTask, but the task only runs on the given worker, e.g. the
+    // one owning the data it touches. It waits for that worker even while
+    // others are idle, and runs even if auto-tuning parked the worker.
+    // Worker ids wrap around the pool's size, so ids beyond it are valid,
+    // e.g. a shard id: 'worker' and 'worker + size' are the same worker.
+    template < class Func, class... Args >
+    auto addTaskOn(size_t worker, Func&& func, Args&&... args)
+        -> std::future<TaskResult<Func, Args...>>
+    {
+        return addTargetedTask(Target(Affinity::PINNED, worker),
+                               std::forward<Func>(func), std::forward<Args>(args)...);
+    }
 
-        auto task = std::make_shared<std::packaged_task<result_type()>>(std::bind(std::forward<Func>(func), std::forward<Args>(args)...));
-        _shared.tasks.emplace_back([task]() { (*task)(); });
-        auto result = task->get_future();
+    // Same as addTaskOn, but only a preference: while the worker is busy,
+    // idle workers may steal the task. Worker ids wrap around the same way.
+    template < class Func, class... Args >
+    auto addTaskNear(size_t worker, Func&& func, Args&&... args)
+        -> std::future<TaskResult<Func, Args...>>
+    {
+        return addTargetedTask(Target(Affinity::PREFERRED, worker),
+                               std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // A lightweight executor sharing the pool's workers, with its own queue
+    // and stats. Executors are given the workers in proportion to their
+    // weights, and together they take turns with the pool's own queues.
+    // Copies refer to the same executor, which lives as long as the pool.
+    class Executor
+    {
+    public:
+        struct Stats
+        {
+            size_t submitted;
+            size_t completed;
+            size_t queued;
+            size_t running;
+            size_t weight;
+        };
+
+        // Same as ThreadPool::addTask, but queued on this executor
+        template < class Func, class... Args >
+        auto addTask(Func&& func, Args&&... args)
+            -> std::future<TaskResult<Func, Args...>>
+        {
+            std::error_code ec;
 
-        if (_shared.tasks.size() == 1)
+            auto result = tryAddTask(ec, std::forward<Func>(func), std::forward<Args>(args)...);
+
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+            if (ec)
+            {
+                throw std::runtime_error("Can't add tasks when not running");
+            }
+#endif
+
+            return result;
+        }
+
+        template < class Func, class... Args >
+        auto tryAddTask(std::error_code & ec, Func&& func, Args&&... args)
+            -> std::future<TaskResult<Func, Args...>>
         {
-            _shared.cond.notify_one();
+            return _pool->submit(ec, _flow, DEFAULT_TRACE_CATEGORY,
+                                 std::forward<Func>(func), std::forward<Args>(args)...);
         }
 
-        return result;
+        void setWeight(size_t weight)
+        {
+            std::lock_guard<std::mutex> guard(_pool->_shared.flows.mutex);
+            _flow->weight = weight ? weight : 1;
+        }
+
+        Stats stats() const
+        {
+            std::lock_guard<std::mutex> guard(_pool->_shared.flows.mutex);
+
+            Stats stats = { _flow->submitted, _flow->completed, _flow->tasks.size(),
+                            _flow->running, _flow->weight };
+            return stats;
+        }
+
+    private:
+        friend class ThreadPool;
+
+        Executor(ThreadPool & pool, Flow & flow)
+            : _pool(&pool), _flow(&flow)
+        {}
+
+        ThreadPool * _pool;
+        Flow *       _flow;
+    };
+
+    // Creates an executor getting 'weight' tasks per round, and running at
+    // most 'limit' tasks at once (zero for no limit). Meant to be created
+    // once per purpose, its queue is only freed along with the pool.
+    Executor makeExecutor(size_t weight = 1, size_t limit = 0)
+    {
+        std::lock_guard<std::mutex> guard(_shared.flows.mutex);
+
+        _shared.flows.all.emplace_back(new Flow(weight, limit));
+        return Executor(*this, *_shared.flows.all.back());
     }
 
-private:
-    typedef std::function<void()> Task;
-    typedef std::deque<Task>      TasksPool;
-    typedef std::thread           Worker;
-    typedef std::vector<Worker>   WorkersPool;
+    // The executor of a tenant, created with weight 1 on first use, so one
+    // tenant flooding the pool can't starve the others. Tenant ids are
+    // expected to be a bounded set, their queues are only freed along with
+    // the pool.
+    Executor tenant(uint64_t id)
+    {
+        std::lock_guard<std::mutex> guard(_shared.flows.mutex);
 
-    struct Shared
+        Flow *& flow = _shared.flows.tenants[id];
+
+        if (!flow)
+        {
+            std::unique_ptr<Flow> created(new Flow(1, 0));
+            _shared.flows.all.push_back(std::move(created));
+            flow = _shared.flows.all.back().get();
+        }
+
+        return Executor(*this, *flow);
+    }
+
+    // Runs its tasks one at a time, in the order they were added, on the
+    // pool's workers, while different strands run in parallel. Meant for
+    // ordered streams (a connection, a shard) without a thread or a lock
+    // each: an idle strand costs nothing but its memory. Copies refer to the
+    // same strand, which lives as long as any copy or any of its tasks. Like
+    // executors, strands refer to their pool, which must outlive them.
+    class Strand
     {
-        bool                    run;
-        TasksPool               tasks;
-        std::mutex              mutex;
-        std::condition_variable cond;
+    public:
+        // Same as ThreadPool::addTask, but queued on this strand
+        template < class Func, class... Args >
+        auto addTask(Func&& func, Args&&... args)
+            -> std::future<TaskResult<Func, Args...>>
+        {
+            std::error_code ec;
+
+            auto result = tryAddTask(ec, std::forward<Func>(func), std::forward<Args>(args)...);
+
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+            if (ec)
+            {
+                throw std::runtime_error("Can't add tasks when not running");
+            }
+#endif
+
+            return result;
+        }
+
+        template < class Func, class... Args >
+        auto tryAddTask(std::error_code & ec, Func&& func, Args&&... args)
+            -> std::future<TaskResult<Func, Args...>>
+        {
+            return _queue->pool->submit(ec, Target(*_queue), DEFAULT_TRACE_CATEGORY,
+                                        std::forward<Func>(func), std::forward<Args>(args)...);
+        }
+
+    private:
+        friend class ThreadPool;
+
+        explicit Strand(std::shared_ptr<StrandQueue> && queue)
+            : _queue(std::move(queue))
+        {}
+
+        std::shared_ptr<StrandQueue> _queue;
     };
 
-private:
-    static void worker(size_t id, Shared & shared)
+    Strand makeStrand()
     {
-        // Use a unique lock as we're going to wait on a cond using it
-        std::unique_lock<std::mutex> lock(shared.mutex);
+        return Strand(std::make_shared<StrandQueue>(*this));
+    }
 
-        while (true)
+    // Runs 'func' on the calling thread, and when called from one of the
+    // pool's tasks, keeps the number of workers taking tasks at its target
+    // meanwhile: a parked worker is woken, or a helper thread takes tasks
+    // until 'func' returns (after finishing its current task). Helpers are
+    // kept for later calls, and only spawned once there are tasks to take.
+    template < class Func >
+    auto blocking(Func&& func) -> decltype(std::forward<Func>(func)())
+    {
+        if (context().shared != &_shared)
         {
-            // Work if there are tasks in the pool
+            return std::forward<Func>(func)();
+        }
 
-            if (!shared.tasks.empty())
-            {
-                // Get the first task
+        BlockingGuard guard(_shared);
+        guard.compensate();
+
+        return std::forward<Func>(func)();
+    }
 
-                Task task = std::move(shared.tasks.front());
-                shared.tasks.pop_front();
+#ifdef THREAD_POOL_HAS_IO_URING
+    // Reads up to 'size' bytes at 'offset' through the pool's io_uring (or
+    // on a worker, where io_uring isn't available), without blocking any of
+    // the workers meanwhile. The future holds the bytes read or -errno. The
+    // buffer must stay valid until then, and stopping the pool waits for the
+    // I/O in flight.
+    std::future<ssize_t> readAsync(int fd, void * buffer, size_t size, uint64_t offset)
+    {
+        return readAsync(fd, buffer, size, offset, [](ssize_t result) { return result; });
+    }
 
-                // Do actual work
-                // IMPORTANT! Must NOT hold lock while working
+    // Same as above, then calls 'then' with the result on one of the workers
+    template < class Func >
+    auto readAsync(int fd, void * buffer, size_t size, uint64_t offset, Func&& then)
+        -> std::future<TaskResult<Func, ssize_t>>
+    {
+        return submitIo(IORING_OP_READV, fd, buffer, size, offset, std::forward<Func>(then));
+    }
 
-                lock.unlock();
-                task();
-                lock.lock();
+    std::future<ssize_t> writeAsync(int fd, const void * buffer, size_t size, uint64_t offset)
+    {
+        return writeAsync(fd, buffer, size, offset, [](ssize_t result) { return result; });
+    }
 
-                continue;
+    template < class Func >
+    auto writeAsync(int fd, const void * buffer, size_t size, uint64_t offset, Func&& then)
+        -> std::future<TaskResult<Func, ssize_t>>
+    {
+        return submitIo(IORING_OP_WRITEV, fd, const_cast<void *>(buffer), size, offset, std::forward<Func>(then));
+    }
+
+    // Calls 'handler' with the ready events on one of the workers whenever
+    // 'fd' is ready for 'events' (EPOLLIN, EPOLLOUT...). The worker waiting
+    // for I/O completions waits for these too, instead of a separate event
+    // loop thread. The fd is re-armed once its handler returns, so a handler
+    // never runs concurrently with itself. Handlers must not throw.
+    // Watching an fd again replaces its handler.
+    template < class Func >
+    std::error_code watch(int fd, uint32_t events, Func&& handler)
+    {
+        IoRing * ring = ioRing();
+
+        if (!ring)
+        {
+            return std::make_error_code(std::errc::operation_not_supported);
+        }
+
+        std::shared_ptr<Watch> entry = std::make_shared<Watch>(fd, events, std::forward<Func>(handler));
+
+        {
+            Watches & watches = _shared.watches;
+            std::lock_guard<std::mutex> guard(watches.mutex);
+
+            if (watches.epoll < 0)
+            {
+                watches.epoll = ::epoll_create1(EPOLL_CLOEXEC);
+
+                if (watches.epoll < 0)
+                {
+                    return std::error_code(errno, std::system_category());
+                }
             }
 
-            // Stop if required
+            struct epoll_event event;
+            event.events = events | EPOLLONESHOT;
+            event.data.fd = fd;
 
-            if (!shared.run)
+            // Closing an fd removes it from epoll, without unwatching it
+            if (::epoll_ctl(watches.epoll, EPOLL_CTL_ADD, fd, &event) < 0 &&
+                (errno != EEXIST || ::epoll_ctl(watches.epoll, EPOLL_CTL_MOD, fd, &event) < 0))
             {
-                // IMPORTANT! Must NOT hold lock after stopped
+                return std::error_code(errno, std::system_category());
+            }
 
-                lock.unlock();
-                break;
+            watches.all[fd] = std::move(entry);
+            watches.count = watches.all.size();
+
+            if (!watches.armed && _shared.run)
+            {
+                arm(_shared, *ring);
             }
+        }
 
-            // Wait until new tasks are populated or the running state has changed
+        // Make sure some worker waits for the events
+        if (!_shared.polling && _shared.idle > 0)
+        {
+            wakeOne(_shared);
+        }
 
-            shared.cond.wait(lock,
-                [&shared](){ return !shared.run || !shared.tasks.empty(); });
+        return std::error_code();
+    }
+
+    // Stops watching 'fd', a handler already running or about to still runs
+    std::error_code unwatch(int fd)
+    {
+        Watches & watches = _shared.watches;
+        std::lock_guard<std::mutex> guard(watches.mutex);
+
+        if (!watches.all.erase(fd))
+        {
+            return std::make_error_code(std::errc::no_such_file_or_directory);
+        }
+
+        watches.count = watches.all.size();
+
+        // Fails if the fd was closed already, which removed it too
+        ::epoll_ctl(watches.epoll, EPOLL_CTL_DEL, fd, nullptr);
+
+        return std::error_code();
+    }
+#endif
+
+#ifdef THREAD_POOL_HAS_EVENTFD
+    // Returns an eventfd that becomes readable when tasks finish, so an event
+    // loop can poll it along with its other fds, or -1 if it can't be created.
+    // Signaled once until acknowledged: call acknowledgeCompletions() and then
+    // collect the futures that are ready.
+    int completionFd()
+    {
+        std::lock_guard<std::mutex> guard(_shared.mutex);
+
+        if (_shared.completions < 0)
+        {
+            _shared.completions = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+
+        return _shared.completions;
+    }
+
+    void acknowledgeCompletions()
+    {
+        int fd = _shared.completions;
+
+        if (fd < 0)
+        {
+            return;
+        }
+
+        uint64_t value;
+        ssize_t bytes = ::read(fd, &value, sizeof(value));
+        (void)bytes;
+
+        // After reading, a task finishing meanwhile signals again. Pairs with
+        // finished(), the futures of tasks that didn't are visible after this.
+        _shared.signaled.exchange(false);
+    }
+#endif
+
+    struct Stats
+    {
+        size_t   workers;     // Threads
+        size_t   active;      // Workers allowed to take tasks, the rest are parked
+        size_t   pending;     // Tasks waiting in the queues
+        uint64_t completed;   // Tasks run since the pool was created
+        double   throughput;  // Tasks per second over the last tuning interval
+        size_t   adjustments; // Times auto-tuning changed the active workers
+    };
+
+    Stats stats() const
+    {
+        Stats stats;
+        stats.workers   = _shared.locals.size();
+        stats.active    = _shared.active;
+        stats.pending   = _shared.pending;
+        stats.completed = completed();
+
+        std::lock_guard<std::mutex> guard(_tuner.mutex);
+        stats.throughput  = _tuner.throughput;
+        stats.adjustments = _tuner.adjustments;
+
+        return stats;
+    }
+
+    // Periodically measures how many tasks complete per second and adjusts
+    // how many of the pool's workers take tasks, between 'min' and 'max'
+    // (the pool's size at most). Climbs while that improves the throughput
+    // and there's a backlog, reverses when it hurts and parks workers when
+    // there's no backlog. Stopping the pool disables it.
+    template < class Rep, class Period >
+    void enableAutoTuning(size_t min, size_t max, const std::chrono::duration<Rep, Period> & interval)
+    {
+        disableAutoTuning();
+
+        if (!_shared.run)
+        {
+            return;
         }
+
+        size_t size = _shared.locals.size();
+        max = std::min(max ? max : size, size);
+        min = std::max<size_t>(std::min(min, max), 1);
+
+        std::lock_guard<std::mutex> guard(_tuner.mutex);
+
+        _tuner.min = min;
+        _tuner.max = max;
+        _tuner.interval = std::chrono::duration_cast<Clock::duration>(interval);
+        _tuner.run = true;
+        _tuner.thread = std::thread(&ThreadPool::tune, this);
+    }
+
+    void enableAutoTuning(size_t min, size_t max = 0)
+    {
+        enableAutoTuning(min, max, std::chrono::milliseconds(DEFAULT_TUNING_INTERVAL_MS));
+    }
+
+    // Stops tuning and lets every worker take tasks again
+    void disableAutoTuning()
+    {
+        {
+            std::lock_guard<std::mutex> guard(_tuner.mutex);
+
+            if (!_tuner.run)
+            {
+                return;
+            }
+
+            _tuner.run = false;
+            _tuner.cond.notify_all();
+        }
+
+        _tuner.thread.join();
+
+        setActive(_shared.locals.size());
+    }
+
+    // Start recording a begin/end event for every task executed from now on.
+    // Each worker keeps the last 'capacity' events in its own ring buffer,
+    // the capacity is fixed by the first call.
+    void enableTracing(size_t capacity = DEFAULT_TRACE_CAPACITY)
+    {
+        std::lock_guard<std::mutex> guard(_shared.mutex);
+
+        if (_shared.traces.empty())
+        {
+            for (size_t id = 0; id < _shared.locals.size(); id++)
+            {
+                _shared.traces.emplace_back(new TraceBuffer(capacity));
+            }
+        }
+
+        _shared.tracing = true;
+    }
+
+    void disableTracing()
+    {
+        _shared.tracing = false;
+    }
+
+    // Write the recorded events using the Chrome trace event format, which
+    // can be opened by chrome://tracing and ui.perfetto.dev
+    void dumpTrace(std::ostream & out) const
+    {
+        out << "{\"traceEvents\":[";
+
+        bool first = true;
+
+        for (size_t id = 0; id < _shared.traces.size(); id++)
+        {
+            out << (first ? "" : ",")
+                << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << id
+                << ",\"args\":{\"name\":\"worker " << id << "\"}}";
+            first = false;
+
+            TraceBuffer & buffer = *_shared.traces[id];
+            std::lock_guard<std::mutex> guard(buffer.mutex);
+
+            size_t count = buffer.wrapped ? buffer.events.size() : buffer.next;
+            size_t start = buffer.wrapped ? buffer.next : 0;
+
+            for (size_t i = 0; i < count; i++)
+            {
+                const TraceEvent & event = buffer.events[(start + i) % buffer.events.size()];
+
+                out << ",{\"name\":\"";
+                writeEscaped(out, event.category);
+                out << "\",\"cat\":\"";
+                writeEscaped(out, event.category);
+                out << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << id
+                    << ",\"ts\":" << sinceEpoch(event.begin)
+                    << ",\"dur\":" << micros(event.end - event.begin)
+                    << ",\"args\":{\"submitted\":" << sinceEpoch(event.submitted)
+                    << ",\"queued\":" << micros(event.begin - event.submitted) << "}}";
+            }
+        }
+
+        out << "],\"displayTimeUnit\":\"ms\"}";
+    }
+
+private:
+    struct Task;
+
+    typedef std::deque<Task *>    TasksPool;
+    typedef std::thread           Worker;
+    typedef std::vector<Worker>   WorkersPool;
+
+    typedef std::chrono::steady_clock Clock;
+
+#ifdef THREAD_POOL_HAS_PMR
+    typedef std::pmr::memory_resource MemoryResource;
+#else
+    typedef void                      MemoryResource;
+#endif
+
+    struct TraceEvent
+    {
+        const char *      category;
+        Clock::time_point submitted;
+        Clock::time_point begin;
+        Clock::time_point end;
+    };
+
+    // Heap storage for over-aligned types, which plain new only honors
+    // from C++17 on
+    struct CacheAligned
+    {
+        static void * operator new(size_t size)
+        {
+            const uintptr_t ALIGN = THREAD_POOL_CACHE_LINE_SIZE;
+
+            void * raw = ::operator new(size + ALIGN);
+            void * ptr = reinterpret_cast<void *>((reinterpret_cast<uintptr_t>(raw) + ALIGN) & ~(ALIGN - 1));
+            static_cast<void **>(ptr)[-1] = raw;
+
+            return ptr;
+        }
+
+        static void operator delete(void * ptr)
+        {
+            ::operator delete(static_cast<void **>(ptr)[-1]);
+        }
+    };
+
+    // Slab allocator for everything allocated per task: the task itself and
+    // its future's shared state. Blocks are recycled through free lists only
+    // the owner touches, blocks freed by other threads are handed back through
+    // a lock free list the owner collects from once its own list runs dry.
+    // Worker heaps are owned by their worker, heaps of outside producers are
+    // shared by all the producers of a queue and allocate under a lock.
+    class alignas(THREAD_POOL_CACHE_LINE_SIZE) TaskHeap : public CacheAligned
+    {
+    public:
+        TaskHeap(bool shared, MemoryResource * resource)
+            : _shared(shared), _resource(resource), _chunk(nullptr), _chunkLeft(0), _owner(nullptr)
+        {
+            for (size_t i = 0; i < CLASSES; i++)
+            {
+                _free[i] = nullptr;
+                _remote[i] = nullptr;
+            }
+        }
+
+        ~TaskHeap()
+        {
+            for (void * chunk : _chunks)
+            {
+                ::operator delete(chunk);
+            }
+        }
+
+        // Called by the worker owning the heap, when it starts and exits (a
+        // restarted pool hands the heap to a new thread)
+        void own(const void * owner = threadTag())
+        {
+            _owner.store(owner, std::memory_order_relaxed);
+        }
+
+        void * allocate(size_t size, size_t align = BLOCK_ALIGN)
+        {
+            if (align > BLOCK_ALIGN || size > MAX_BLOCK - HEADER ||
+                (!_shared && _owner.load(std::memory_order_relaxed) != threadTag()))
+            {
+                return allocateGlobal(size, align);
+            }
+
+#ifdef THREAD_POOL_HAS_PMR
+            if (_resource)
+            {
+                Header * header = static_cast<Header *>(_resource->allocate(size + HEADER, BLOCK_ALIGN));
+                header->heap  = this;
+                header->value = size + HEADER;
+                return header + 1;
+            }
+#endif
+
+            std::unique_lock<std::mutex> lock(_lock, std::defer_lock);
+            if (_shared)
+            {
+                lock.lock();
+            }
+
+            size_t sizeClass = 0;
+            while ((MIN_BLOCK << sizeClass) < size + HEADER)
+            {
+                sizeClass++;
+            }
+
+            Block * block = _free[sizeClass];
+            if (!block)
+            {
+                block = _remote[sizeClass].exchange(nullptr, std::memory_order_acquire);
+            }
+
+            if (block)
+            {
+                _free[sizeClass] = block->next;
+            }
+            else
+            {
+                block = carve(MIN_BLOCK << sizeClass);
+            }
+
+            Header * header = reinterpret_cast<Header *>(block);
+            header->heap  = this;
+            header->value = sizeClass;
+            return header + 1;
+        }
+
+        // Any thread
+        static void deallocate(void * ptr)
+        {
+            Header * header = static_cast<Header *>(ptr) - 1;
+
+            if (!header->heap)
+            {
+                ::operator delete(static_cast<char *>(ptr) - header->value);
+                return;
+            }
+
+            header->heap->release(header);
+        }
+
+    private:
+        static const size_t CLASSES     = 5;
+        static const size_t MIN_BLOCK   = 64;
+        static const size_t MAX_BLOCK   = MIN_BLOCK << (CLASSES - 1);
+        static const size_t CHUNK_SIZE  = 64 * 1024;
+        static const size_t BLOCK_ALIGN = 16;
+        static const size_t HEADER      = 16;
+
+        // Precedes every block handed out
+        struct Header
+        {
+            TaskHeap * heap;  // Null when allocated globally
+            size_t     value; // Size class, size for resources or offset for global blocks
+        };
+
+        struct Block
+        {
+            Block * next;
+        };
+
+        static const void * threadTag()
+        {
+            static thread_local char tag;
+            return &tag;
+        }
+
+        static void * allocateGlobal(size_t size, size_t align)
+        {
+            align = align > BLOCK_ALIGN ? align : BLOCK_ALIGN;
+
+            char * raw = static_cast<char *>(::operator new(size + HEADER + align));
+            char * ptr = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(raw) + HEADER + align - 1) & ~(uintptr_t)(align - 1));
+
+            Header * header = reinterpret_cast<Header *>(ptr) - 1;
+            header->heap  = nullptr;
+            header->value = ptr - raw;
+            return ptr;
+        }
+
+        void release(Header * header)
+        {
+#ifdef THREAD_POOL_HAS_PMR
+            if (_resource)
+            {
+                _resource->deallocate(header, header->value, BLOCK_ALIGN);
+                return;
+            }
+#endif
+
+            size_t sizeClass = header->value;
+            Block * block = reinterpret_cast<Block *>(header);
+
+            if (!_shared && _owner.load(std::memory_order_relaxed) == threadTag())
+            {
+                block->next = _free[sizeClass];
+                _free[sizeClass] = block;
+                return;
+            }
+
+            block->next = _remote[sizeClass].load(std::memory_order_relaxed);
+            while (!_remote[sizeClass].compare_exchange_weak(block->next, block,
+                        std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        Block * carve(size_t size)
+        {
+            if (_chunkLeft < size)
+            {
+                _chunks.reserve(_chunks.size() + 1);
+                _chunk = static_cast<char *>(::operator new(CHUNK_SIZE));
+                _chunks.push_back(_chunk);
+                _chunkLeft = CHUNK_SIZE;
+            }
+
+            Block * block = reinterpret_cast<Block *>(_chunk);
+            _chunk += size;
+            _chunkLeft -= size;
+            return block;
+        }
+
+    private:
+        const bool           _shared;
+        MemoryResource *     _resource;
+        std::mutex           _lock;
+        Block *              _free[CLASSES];
+        char *               _chunk;
+        size_t               _chunkLeft;
+        std::vector<void *>  _chunks;
+        std::atomic<const void *> _owner;
+
+        // Written by other threads
+        alignas(THREAD_POOL_CACHE_LINE_SIZE) std::atomic<Block *> _remote[CLASSES];
+    };
+
+    typedef std::vector<std::shared_ptr<TaskHeap>> TaskHeaps;
+
+    // Allocates futures' shared states from a task heap, keeping the heap
+    // alive for as long as the state exists
+    template < class T >
+    struct HeapAllocator
+    {
+        typedef T value_type;
+
+        explicit HeapAllocator(const std::shared_ptr<TaskHeap> & heap)
+            : heap(heap)
+        {}
+
+        template < class U >
+        HeapAllocator(const HeapAllocator<U> & other)
+            : heap(other.heap)
+        {}
+
+        T * allocate(size_t n)
+        {
+            return static_cast<T *>(heap->allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T * ptr, size_t)
+        {
+            TaskHeap::deallocate(ptr);
+        }
+
+        template < class U >
+        bool operator==(const HeapAllocator<U> & other) const
+        {
+            return heap == other.heap;
+        }
+
+        template < class U >
+        bool operator!=(const HeapAllocator<U> & other) const
+        {
+            return heap != other.heap;
+        }
+
+        std::shared_ptr<TaskHeap> heap;
+    };
+
+    // Type erased unit of work, living in a task heap block
+    struct Task
+    {
+        Task()
+            : category(nullptr), flow(nullptr), next(nullptr)
+        {}
+
+        virtual ~Task()
+        {}
+
+        virtual void run() = 0;
+
+        // Called on a task dropped by stop(true), before it's destroyed
+        virtual void cancel()
+        {}
+
+#ifdef THREAD_POOL_HAS_IO_URING
+        // Hands an I/O task its operation's result before it runs
+        virtual void complete(ssize_t)
+        {}
+#endif
+
+        // Only set when tracing
+        const char *      category;
+        Clock::time_point submitted;
+
+        // The executor's queue the task was submitted to, if any
+        Flow *            flow;
+
+        // Links the task in a strand's queue
+        std::atomic<Task *> next;
+    };
+
+    template < size_t... I >
+    struct Indices
+    {};
+
+    template < size_t N, size_t... I >
+    struct MakeIndices : MakeIndices<N - 1, N - 1, I...>
+    {};
+
+    template < size_t... I >
+    struct MakeIndices<0, I...>
+    {
+        typedef Indices<I...> type;
+    };
+
+#ifndef THREAD_POOL_HAS_INVOKE
+    // Member pointers are conservatively assumed to throw
+    template < bool Member, class Func, class... Args >
+    struct IsNothrowCallable : std::false_type
+    {};
+
+    template < class Func, class... Args >
+    struct IsNothrowCallable<false, Func, Args...>
+        : std::integral_constant<bool, noexcept(std::declval<Func>()(std::declval<Args>()...))>
+    {};
+#endif
+
+    // Tags the constructor below, so it never competes with copy and move
+    struct Forward
+    {};
+
+    // A function with its arguments, invoked once by moving them into the
+    // call, so move-only and large arguments are never copied
+    template < class Func, class... Args >
+    struct Callable
+    {
+        template < class F, class... A >
+        Callable(Forward, F&& func, A&&... args)
+            : func(std::forward<F>(func)), args(std::forward<A>(args)...)
+        {}
+
+        TaskResult<Func, Args...> operator()()
+        {
+            return call(typename MakeIndices<sizeof...(Args)>::type());
+        }
+
+        // Whether the call itself (including moving the arguments into it)
+        // might throw, decided at compile time
+#ifdef THREAD_POOL_HAS_INVOKE
+        static constexpr bool CALL_NOTHROW = std::is_nothrow_invocable<Func, Args...>::value;
+#else
+        static constexpr bool CALL_NOTHROW = IsNothrowCallable<std::is_member_pointer<Func>::value, Func, Args...>::value;
+#endif
+
+        // Storing the result moves it into the future, which might throw too
+        static constexpr bool NOTHROW = CALL_NOTHROW &&
+            (std::is_void<TaskResult<Func, Args...>>::value ||
+             std::is_nothrow_move_constructible<TaskResult<Func, Args...>>::value);
+
+        template < size_t... I >
+        TaskResult<Func, Args...> call(Indices<I...>)
+        {
+#ifdef THREAD_POOL_HAS_INVOKE
+            return std::invoke(std::move(func), std::move(std::get<I>(args))...);
+#else
+            return invoke(std::is_member_pointer<Func>(), std::move(func), std::move(std::get<I>(args))...);
+#endif
+        }
+
+        Func                func;
+        std::tuple<Args...> args;
+    };
+
+#ifndef THREAD_POOL_HAS_INVOKE
+    template < class Func, class... Args >
+    static auto invoke(std::false_type, Func&& func, Args&&... args)
+        -> decltype(std::forward<Func>(func)(std::forward<Args>(args)...))
+    {
+        return std::forward<Func>(func)(std::forward<Args>(args)...);
+    }
+
+    // Member pointers are called on the first argument, an object or a pointer
+    template < class Func, class... Args >
+    static auto invoke(std::true_type, Func&& func, Args&&... args)
+        -> decltype(std::mem_fn(func)(std::forward<Args>(args)...))
+    {
+        return std::mem_fn(func)(std::forward<Args>(args)...);
+    }
+#endif
+
+    template < class Result, class Function >
+    struct BoundTask : Task
+    {
+        BoundTask(Function && callable, std::promise<Result> && promise)
+            : callable(std::move(callable)), promise(std::move(promise))
+        {}
+
+        void run() override
+        {
+            run(std::integral_constant<bool, Function::NOTHROW>());
+        }
+
+        // Tasks that can't throw skip capturing exceptions altogether
+        void run(std::true_type)
+        {
+            fulfill(promise, callable);
+        }
+
+        void run(std::false_type)
+        {
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+            try
+            {
+                fulfill(promise, callable);
+            }
+            catch (...)
+            {
+                promise.set_exception(std::current_exception());
+            }
+#else
+            fulfill(promise, callable);
+#endif
+        }
+
+        Function             callable;
+        std::promise<Result> promise;
+    };
+
+#ifdef THREAD_POOL_HAS_IO_URING
+    // Reads or writes, then calls its function with the result (the bytes
+    // transferred, or -errno) as its only argument
+    template < class Result, class Function >
+    struct IoTask : BoundTask<Result, Function>
+    {
+        IoTask(Function && callable, std::promise<Result> && promise,
+               uint8_t opcode, int fd, void * buffer, size_t size, uint64_t offset)
+            : BoundTask<Result, Function>(std::move(callable), std::move(promise)),
+              opcode(opcode), fd(fd), offset(offset), done(false)
+        {
+            iov.iov_base = buffer;
+            iov.iov_len = size;
+        }
+
+        void complete(ssize_t result) override
+        {
+            std::get<0>(this->callable.args) = result;
+            done = true;
+        }
+
+        void run() override
+        {
+            // Without a ring, the worker does the I/O itself
+            if (!done)
+            {
+                complete(transfer());
+            }
+
+            BoundTask<Result, Function>::run();
+        }
+
+        ssize_t transfer()
+        {
+            ssize_t result = opcode == IORING_OP_READV
+                ? ::preadv(fd, &iov, 1, static_cast<off_t>(offset))
+                : ::pwritev(fd, &iov, 1, static_cast<off_t>(offset));
+
+            return result < 0 ? -errno : result;
+        }
+
+        uint8_t      opcode;
+        int          fd;
+        struct iovec iov;
+        uint64_t     offset;
+        bool         done;
+    };
+#endif
+
+    struct alignas(THREAD_POOL_CACHE_LINE_SIZE) TraceBuffer : CacheAligned
+    {
+        explicit TraceBuffer(size_t capacity)
+            : events(capacity ? capacity : 1), next(0), wrapped(false)
+        {}
+
+        // Only contended when dumping while the pool is running
+        std::mutex              mutex;
+        std::vector<TraceEvent> events;
+        size_t                  next;
+        bool                    wrapped;
+    };
+
+    typedef std::vector<std::unique_ptr<TraceBuffer>> TraceBuffers;
+
+    struct alignas(THREAD_POOL_CACHE_LINE_SIZE) Queue : CacheAligned
+    {
+        ~Queue()
+        {
+            for (Task * task : tasks)
+            {
+                destroyTask(task);
+            }
+        }
+
+        std::mutex              mutex;
+        TasksPool               tasks;
+    };
+
+    typedef std::vector<std::unique_ptr<Queue>> Queues;
+
+    // Tasks given an affinity to a worker. Pinned tasks only run on it, and
+    // aren't counted as pending, so the other workers don't wake up for them.
+    // Preferred tasks run there first, but idle workers steal them.
+    struct alignas(THREAD_POOL_CACHE_LINE_SIZE) Mailbox : CacheAligned
+    {
+        Mailbox()
+            : pinnedCount(0), preferredCount(0)
+        {}
+
+        ~Mailbox()
+        {
+            for (Task * task : pinned)
+            {
+                destroyTask(task);
+            }
+            for (Task * task : preferred)
+            {
+                destroyTask(task);
+            }
+        }
+
+        std::mutex              mutex;
+        TasksPool               pinned;
+        TasksPool               preferred;
+        std::atomic<size_t>     pinnedCount; // Checked without the lock
+        std::atomic<size_t>     preferredCount;
+    };
+
+    typedef std::vector<std::unique_ptr<Mailbox>> Mailboxes;
+
+    // Bounded work stealing deque (Chase-Lev) holding the tasks a worker
+    // submits to its own pool. The owner pushes and pops at the bottom
+    // without locking, other workers steal from the top.
+    class alignas(THREAD_POOL_CACHE_LINE_SIZE) LocalQueue : public CacheAligned
+    {
+    public:
+        static const size_t CAPACITY = 256; // Must be a power of 2
+
+        LocalQueue()
+            : _tasks(new std::atomic<Task *>[CAPACITY]), _top(0), _bottom(0)
+        {}
+
+        ~LocalQueue()
+        {
+            while (Task * task = steal())
+            {
+                destroyTask(task);
+            }
+        }
+
+        // Owner only, fails when full
+        bool push(Task * task)
+        {
+            long long b = _bottom.load(std::memory_order_relaxed);
+            long long t = _top.load(std::memory_order_acquire);
+
+            if (b - t >= (long long)CAPACITY)
+            {
+                return false;
+            }
+
+            _tasks[b & (CAPACITY - 1)].store(task, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            _bottom.store(b + 1, std::memory_order_relaxed);
+
+            return true;
+        }
+
+        // Owner only, takes the most recently pushed task
+        Task * pop()
+        {
+            long long b = _bottom.load(std::memory_order_relaxed) - 1;
+            _bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            long long t = _top.load(std::memory_order_relaxed);
+
+            if (t > b)
+            {
+                _bottom.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            Task * task = _tasks[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+
+            // Last task, race the thieves for it
+            if (t == b)
+            {
+                if (!_top.compare_exchange_strong(t, t + 1,
+                        std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    task = nullptr;
+                }
+
+                _bottom.store(b + 1, std::memory_order_relaxed);
+            }
+
+            return task;
+        }
+
+        // Any thread, takes the oldest task
+        Task * steal()
+        {
+            while (true)
+            {
+                long long t = _top.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                long long b = _bottom.load(std::memory_order_acquire);
+
+                if (t >= b)
+                {
+                    return nullptr;
+                }
+
+                Task * task = _tasks[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+
+                if (_top.compare_exchange_strong(t, t + 1,
+                        std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    return task;
+                }
+            }
+        }
+
+    private:
+        std::unique_ptr<std::atomic<Task *>[]> _tasks;
+
+        // Written by thieves
+        alignas(THREAD_POOL_CACHE_LINE_SIZE) std::atomic<long long> _top;
+
+        // Written by the owner
+        alignas(THREAD_POOL_CACHE_LINE_SIZE) std::atomic<long long> _bottom;
+    };
+
+    typedef std::vector<std::unique_ptr<LocalQueue>> LocalQueues;
+
+    // Written by its worker only, read when collecting stats
+    struct alignas(THREAD_POOL_CACHE_LINE_SIZE) Counters : CacheAligned
+    {
+        Counters()
+            : completed(0)
+        {}
+
+        std::atomic<uint64_t> completed;
+    };
+
+    typedef std::vector<std::unique_ptr<Counters>> WorkersCounters;
+
+    // Blocks a single worker until unparked. Unparking is a store and a
+    // single futex wake, the worker doesn't reacquire any lock.
+    class Parker
+    {
+    public:
+        Parker()
+            : _state(AWAKE)
+        {}
+
+        // Called before the worker publishes itself as idle
+        void prepare()
+        {
+            _state.store(SLEEPING);
+        }
+
+        // Called by the worker when it took itself back before sleeping
+        void cancel()
+        {
+            _state.store(AWAKE, std::memory_order_relaxed);
+        }
+
+        void wait()
+        {
+#if defined(THREAD_POOL_HAS_FUTEX)
+            while (_state.load(std::memory_order_acquire) == SLEEPING)
+            {
+                ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_state), FUTEX_WAIT_PRIVATE,
+                          SLEEPING, nullptr, nullptr, 0);
+            }
+#elif defined(THREAD_POOL_HAS_ATOMIC_WAIT)
+            while (_state.load(std::memory_order_acquire) == SLEEPING)
+            {
+                _state.wait(SLEEPING, std::memory_order_acquire);
+            }
+#else
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cond.wait(lock, [this](){ return _state.load(std::memory_order_acquire) != SLEEPING; });
+#endif
+        }
+
+        void unpark()
+        {
+#if defined(THREAD_POOL_HAS_FUTEX)
+            _state.store(AWAKE, std::memory_order_release);
+            ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_state), FUTEX_WAKE_PRIVATE,
+                      1, nullptr, nullptr, 0);
+#elif defined(THREAD_POOL_HAS_ATOMIC_WAIT)
+            _state.store(AWAKE, std::memory_order_release);
+            _state.notify_one();
+#else
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _state.store(AWAKE, std::memory_order_release);
+            }
+            _cond.notify_one();
+#endif
+        }
+
+    private:
+        static const uint32_t AWAKE = 0;
+        static const uint32_t SLEEPING = 1;
+
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "A futex is a plain 32 bit word");
+
+        std::atomic<uint32_t>   _state;
+#if !defined(THREAD_POOL_HAS_FUTEX) && !defined(THREAD_POOL_HAS_ATOMIC_WAIT)
+        std::mutex              _mutex;
+        std::condition_variable _cond;
+#endif
+    };
+
+    // The idle workers, each sleeping on its own parker. A worker publishes
+    // itself as idle, re-checks whether it has anything to do and only then
+    // sleeps. Waking one claims its bit, so exactly one thread unparks it.
+    // Idle workers are also pushed on a lock free stack, and the most recently
+    // idled one is woken first: its caches are still warm, and the others get
+    // to sleep on (and their cores to enter deeper C-states).
+    class ParkingLot
+    {
+    public:
+        ParkingLot()
+            : _head(0)
+        {}
+
+        void resize(size_t workers)
+        {
+            _words = (workers + BITS - 1) / BITS;
+            _idle.reset(new std::atomic<uint64_t>[_words]);
+            for (size_t i = 0; i < _words; i++)
+            {
+                _idle[i] = 0;
+            }
+
+            for (size_t id = 0; id < workers; id++)
+            {
+                _slots.emplace_back(new Slot());
+            }
+        }
+
+        void park(size_t id)
+        {
+            Slot & slot = *_slots[id];
+
+            slot.parker.prepare();
+            _idle[id / BITS].fetch_or(bit(id));
+
+            // A worker retracted or woken by unparkAll() may still be stacked,
+            // where it stays. Pairs with pop(), which checks the bit after.
+            if (!slot.stacked.exchange(true))
+            {
+                push(id);
+            }
+        }
+
+        // Takes a parked worker back before it sleeps, returns false if it's
+        // being unparked already (it must wait() then, which returns soon)
+        bool retract(size_t id)
+        {
+            if (_idle[id / BITS].fetch_and(~bit(id)) & bit(id))
+            {
+                _slots[id]->parker.cancel();
+                return true;
+            }
+
+            return false;
+        }
+
+        void wait(size_t id)
+        {
+            _slots[id]->parker.wait();
+        }
+
+        // Unparks the most recently parked worker, false when none is parked.
+        // Stacked workers that aren't parked anymore are dropped on the way.
+        bool unparkOne()
+        {
+            size_t id;
+
+            while (pop(id))
+            {
+                _slots[id]->stacked = false;
+
+                if (_idle[id / BITS].fetch_and(~bit(id)) & bit(id))
+                {
+                    _slots[id]->parker.unpark();
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // Unparks the given worker, false when it isn't parked. Leaves it
+        // stacked, like unparkAll().
+        bool unpark(size_t id)
+        {
+            if (_idle[id / BITS].fetch_and(~bit(id)) & bit(id))
+            {
+                _slots[id]->parker.unpark();
+                return true;
+            }
+
+            return false;
+        }
+
+        // Leaves the workers stacked, they're dropped when popped
+        void unparkAll()
+        {
+            for (size_t i = 0; i < _words; i++)
+            {
+                uint64_t idle = _idle[i].exchange(0);
+
+                for (; idle; idle &= idle - 1)
+                {
+                    _slots[i * BITS + index(idle & (~idle + 1))]->parker.unpark();
+                }
+            }
+        }
+
+    private:
+        static const size_t BITS = 64;
+
+        static uint64_t bit(size_t id)
+        {
+            return uint64_t(1) << (id % BITS);
+        }
+
+        static size_t index(uint64_t bit)
+        {
+#if defined(__GNUC__)
+            return static_cast<size_t>(__builtin_ctzll(bit));
+#else
+            size_t index = 0;
+            while (bit >>= 1)
+            {
+                index++;
+            }
+            return index;
+#endif
+        }
+
+        // The stack's head packs a version (against ABA) with the top
+        // worker's id plus one, zero when empty. So do the links.
+        static const uint64_t EMPTY = 0;
+
+        void push(size_t id)
+        {
+            Slot & slot = *_slots[id];
+            uint64_t head = _head.load();
+
+            do
+            {
+                slot.next = static_cast<uint32_t>(head);
+            }
+            while (!_head.compare_exchange_weak(head, link(head, id + 1)));
+        }
+
+        bool pop(size_t & id)
+        {
+            uint64_t head = _head.load();
+
+            while (static_cast<uint32_t>(head) != EMPTY)
+            {
+                // Read before it's popped, the version fails the exchange if
+                // it was popped and pushed again meanwhile
+                size_t top = static_cast<uint32_t>(head) - 1;
+                uint32_t next = _slots[top]->next;
+
+                if (_head.compare_exchange_weak(head, link(head, next)))
+                {
+                    id = top;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        static uint64_t link(uint64_t head, uint32_t top)
+        {
+            return (((head >> 32) + 1) << 32) | top;
+        }
+
+        // A worker's parker and its link in the stack, on its own cache line
+        struct alignas(THREAD_POOL_CACHE_LINE_SIZE) Slot : CacheAligned
+        {
+            Slot()
+                : next(0), stacked(false)
+            {}
+
+            Parker                parker;
+            std::atomic<uint32_t> next;
+            std::atomic<bool>     stacked;
+        };
+
+        std::vector<std::unique_ptr<Slot>>          _slots;
+        std::unique_ptr<std::atomic<uint64_t>[]>    _idle; // A bit per parked worker
+        size_t                                      _words;
+        std::atomic<uint64_t>                       _head; // Of the idle workers' stack
+    };
+
+    // A thread making up for a blocked worker, see helper()
+    struct Helper
+    {
+        Helper()
+            : done(false)
+        {}
+
+        std::thread thread;
+        bool        done;
+    };
+
+    typedef std::list<Helper> Helpers;
+
+    // Auto-tuning state, guarded by its mutex
+    struct Tuner
+    {
+        Tuner()
+            : run(false), min(0), max(0), interval(0), throughput(0), adjustments(0)
+        {}
+
+        mutable std::mutex      mutex;
+        std::condition_variable cond;
+        std::thread             thread;
+        bool                    run;
+        size_t                  min;
+        size_t                  max;
+        Clock::duration         interval;
+        double                  throughput;
+        size_t                  adjustments;
+    };
+
+#ifdef THREAD_POOL_HAS_IO_URING
+    // The pool's io_uring instance. Submissions are serialized by a lock and
+    // sent to the kernel right away, completions are reaped by one thread at
+    // a time. A completion's user data is the task to schedule, zero for the
+    // no-ops waking up a thread waiting for completions, or the pool's
+    // Watches when its epoll instance is ready.
+    class IoRing
+    {
+    public:
+        static const unsigned ENTRIES = 256;
+
+        // Returns null when io_uring isn't available (old kernel, seccomp...)
+        static IoRing * create()
+        {
+            struct io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+
+            int fd = static_cast<int>(::syscall(__NR_io_uring_setup, ENTRIES, &params));
+            if (fd < 0)
+            {
+                return nullptr;
+            }
+
+            std::unique_ptr<IoRing> ring(new IoRing(fd));
+            return ring->map(params) ? ring.release() : nullptr;
+        }
+
+        ~IoRing()
+        {
+            if (_sqes != MAP_FAILED)
+            {
+                ::munmap(_sqes, _sqesSize);
+            }
+            if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+            {
+                ::munmap(_cqRing, _cqRingSize);
+            }
+            if (_sqRing != MAP_FAILED)
+            {
+                ::munmap(_sqRing, _sqRingSize);
+            }
+            ::close(_fd);
+        }
+
+        // Submits unless admit() returns false (called under the submission
+        // lock). Returns zero, -errno, or 1 when not admitted. 'events' are
+        // the poll events of a POLL_ADD.
+        template < class Admit >
+        int submit(uint8_t opcode, int fd, const struct iovec * iov, uint64_t offset, uint64_t data,
+                   Admit admit, unsigned short events = 0)
+        {
+            std::lock_guard<std::mutex> guard(_submitLock);
+
+            if (!admit())
+            {
+                return 1;
+            }
+
+            unsigned tail = *_sqTail;
+            unsigned index = tail & *_sqMask;
+
+            struct io_uring_sqe & sqe = _sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = opcode;
+            sqe.fd = fd;
+            sqe.off = offset;
+            sqe.addr = reinterpret_cast<uint64_t>(iov);
+            sqe.len = iov ? 1 : 0;
+            sqe.poll_events = events;
+            sqe.user_data = data;
+
+            _sqArray[index] = index;
+            __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+            while (true)
+            {
+                long submitted = ::syscall(__NR_io_uring_enter, _fd, 1, 0, 0, nullptr, 0);
+
+                if (submitted >= 0)
+                {
+                    return 0;
+                }
+
+                if (errno != EINTR)
+                {
+                    // Take the entry back, the kernel didn't consume it
+                    __atomic_store_n(_sqTail, tail, __ATOMIC_RELEASE);
+                    return -errno;
+                }
+            }
+        }
+
+        void wake()
+        {
+            submit(IORING_OP_NOP, -1, nullptr, 0, 0, [](){ return true; });
+        }
+
+        // Every submission admitted before is sent once this returns
+        void barrier()
+        {
+            std::lock_guard<std::mutex> guard(_submitLock);
+        }
+
+        bool ready() const
+        {
+            return __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE) != __atomic_load_n(_cqHead, __ATOMIC_RELAXED);
+        }
+
+        // Blocks until there's a completion to reap
+        void wait()
+        {
+            ::syscall(__NR_io_uring_enter, _fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        }
+
+        // Calls handler(data, result) for every completion, unless another
+        // thread is already reaping. Returns how many were reaped.
+        template < class Handler >
+        size_t reap(Handler handler)
+        {
+            std::unique_lock<std::mutex> lock(_reapLock, std::try_to_lock);
+
+            if (!lock.owns_lock())
+            {
+                return 0;
+            }
+
+            size_t count = 0;
+            unsigned head = *_cqHead;
+            unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+
+            for (; head != tail; head++, count++)
+            {
+                const struct io_uring_cqe & cqe = _cqes[head & *_cqMask];
+                uint64_t data = cqe.user_data;
+                ssize_t result = cqe.res;
+
+                __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+
+                handler(data, result);
+            }
+
+            return count;
+        }
+
+    private:
+        explicit IoRing(int fd)
+            : _fd(fd), _sqRing(MAP_FAILED), _sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)), _cqRing(MAP_FAILED)
+        {}
+
+        bool map(const struct io_uring_params & params)
+        {
+            _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+            {
+                _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+            }
+
+            _sqRing = ::mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             _fd, IORING_OFF_SQ_RING);
+            if (_sqRing == MAP_FAILED)
+            {
+                return false;
+            }
+
+            _cqRing = (params.features & IORING_FEAT_SINGLE_MMAP)
+                ? _sqRing
+                : ::mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         _fd, IORING_OFF_CQ_RING);
+            if (_cqRing == MAP_FAILED)
+            {
+                return false;
+            }
+
+            _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+            _sqes = static_cast<struct io_uring_sqe *>(::mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE,
+                                                              MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES));
+            if (_sqes == MAP_FAILED)
+            {
+                return false;
+            }
+
+            char * sq = static_cast<char *>(_sqRing);
+            _sqTail  = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            _sqMask  = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            _sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+            char * cq = static_cast<char *>(_cqRing);
+            _cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            _cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            _cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            _cqes   = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+            return true;
+        }
+
+        int                    _fd;
+        std::mutex             _submitLock;
+        std::mutex             _reapLock;
+
+        void *                 _sqRing;
+        size_t                 _sqRingSize;
+        unsigned *             _sqTail;
+        unsigned *             _sqMask;
+        unsigned *             _sqArray;
+        struct io_uring_sqe *  _sqes;
+        size_t                 _sqesSize;
+
+        void *                 _cqRing;
+        size_t                 _cqRingSize;
+        unsigned *             _cqHead;
+        unsigned *             _cqTail;
+        unsigned *             _cqMask;
+        struct io_uring_cqe *  _cqes;
+    };
+
+    // An fd watched through the pool's epoll instance
+    struct Watch
+    {
+        template < class Func >
+        Watch(int fd, uint32_t events, Func&& handler)
+            : fd(fd), events(events), handler(std::forward<Func>(handler))
+        {}
+
+        int                           fd;
+        uint32_t                      events;
+        std::function<void(uint32_t)> handler;
+    };
+
+    // The watched fds are registered one-shot in an epoll instance, which is
+    // itself polled through the ring while the pool runs
+    struct Watches
+    {
+        static const int BATCH = 64; // Events taken per wake-up
+
+        std::mutex                                       mutex;
+        int                                              epoll;
+        bool                                             armed; // Polled through the ring
+        std::unordered_map<int, std::shared_ptr<Watch>> all;
+        std::atomic<size_t>                              count;
+    };
+
+    // Calls a watch's handler, then re-arms its fd unless it was unwatched
+    struct WatchTask : Task
+    {
+        WatchTask(Watches & watches, std::shared_ptr<Watch> watch, uint32_t events)
+            : watches(watches), watch(std::move(watch)), events(events)
+        {}
+
+        void run() override
+        {
+            watch->handler(events);
+
+            std::lock_guard<std::mutex> guard(watches.mutex);
+
+            auto it = watches.all.find(watch->fd);
+            if (it != watches.all.end() && it->second == watch)
+            {
+                struct epoll_event event;
+                event.events = watch->events | EPOLLONESHOT;
+                event.data.fd = watch->fd;
+
+                ::epoll_ctl(watches.epoll, EPOLL_CTL_MOD, watch->fd, &event);
+            }
+        }
+
+        Watches &              watches;
+        std::shared_ptr<Watch> watch;
+        uint32_t               events;
+    };
+#endif
+
+    // An executor's queue. Its queued tasks are counted as pending only while
+    // it runs less tasks than its limit, so workers never spin on it.
+    struct Flow
+    {
+        Flow(size_t weight, size_t limit)
+            : weight(weight ? weight : 1), limit(limit), deficit(0), running(0),
+              submitted(0), completed(0), active(false), next(nullptr), prev(nullptr)
+        {}
+
+        ~Flow()
+        {
+            for (Task * task : tasks)
+            {
+                destroyTask(task);
+            }
+        }
+
+        bool counted() const
+        {
+            return !limit || running < limit;
+        }
+
+        TasksPool tasks;
+        size_t    weight;
+        size_t    limit;     // Tasks running at once, zero for no limit
+        size_t    deficit;   // Tasks left to take in the current round
+        size_t    running;
+        size_t    submitted;
+        size_t    completed;
+
+        // Round robin links, only while there are tasks to take
+        bool      active;
+        Flow *    next;
+        Flow *    prev;
+    };
+
+    // The executors' queues, taken from by deficit round robin over the
+    // active ones, so picking the next task is O(1) however many there are
+    struct Flows
+    {
+        Flows()
+            : head(nullptr), runnable(0)
+        {}
+
+        void link(Flow & flow)
+        {
+            if (flow.active)
+            {
+                return;
+            }
+
+            if (!head)
+            {
+                flow.next = flow.prev = &flow;
+                head = &flow;
+            }
+            else
+            {
+                flow.next = head;
+                flow.prev = head->prev;
+                head->prev->next = &flow;
+                head->prev = &flow;
+            }
+
+            flow.active = true;
+        }
+
+        void unlinkHead()
+        {
+            Flow & flow = *head;
+
+            if (flow.next == &flow)
+            {
+                head = nullptr;
+            }
+            else
+            {
+                flow.prev->next = flow.next;
+                flow.next->prev = flow.prev;
+                head = flow.next;
+            }
+
+            flow.active = false;
+            flow.deficit = 0;
+        }
+
+        std::mutex                         mutex;
+        std::vector<std::unique_ptr<Flow>> all;
+        std::unordered_map<uint64_t, Flow *> tenants;
+        Flow *                             head;
+        std::atomic<size_t>                runnable; // Tasks counted as pending
+    };
+
+    // A strand's tasks, run in order by a single drain task scheduled on the
+    // pool while there are any. Producers push without locking (Vyukov's
+    // intrusive MPSC queue), and only the one finding the strand idle
+    // schedules the drain, which owns popping until it clears 'scheduled'.
+    struct StrandQueue : std::enable_shared_from_this<StrandQueue>
+    {
+        // Tasks run per drain task, before making way for the pool's others
+        static const size_t BATCH = 64;
+
+        struct Stub : Task
+        {
+            void run() override
+            {}
+        };
+
+        explicit StrandQueue(ThreadPool & pool)
+            : pool(&pool), tail(&stub), head(&stub), scheduled(false)
+        {}
+
+        ~StrandQueue()
+        {
+            while (Task * task = pop())
+            {
+                destroyTask(task);
+            }
+        }
+
+        void push(Task * task)
+        {
+            task->next.store(nullptr, std::memory_order_relaxed);
+            Task * prev = tail.exchange(task);
+            prev->next.store(task, std::memory_order_release);
+        }
+
+        // Returns nullptr when empty, or when the last task is still being
+        // pushed (release() tells the two apart)
+        Task * pop()
+        {
+            Task * first = head;
+            Task * next = first->next.load(std::memory_order_acquire);
+
+            if (first == &stub)
+            {
+                if (!next)
+                {
+                    return nullptr;
+                }
+
+                head = next;
+                first = next;
+                next = next->next.load(std::memory_order_acquire);
+            }
+
+            if (next)
+            {
+                head = next;
+                return first;
+            }
+
+            if (first != tail.load())
+            {
+                return nullptr;
+            }
+
+            // The last task, the stub takes its place
+            push(&stub);
+            next = first->next.load(std::memory_order_acquire);
+
+            if (next)
+            {
+                head = next;
+                return first;
+            }
+
+            return nullptr;
+        }
+
+        // Clears 'scheduled' once empty, returns false if tasks were pushed
+        // meanwhile and popping is still up to the caller
+        bool release()
+        {
+            // Only the stub left, a last task would be both head and tail
+            if (head != &stub || tail.load() != &stub)
+            {
+                return false;
+            }
+
+            scheduled = false;
+
+            // Pairs with producers pushing, then setting the flag. Another
+            // drain may own the head by now, only the stub is pushed back.
+            return tail.load() == &stub || scheduled.exchange(true);
+        }
+
+        // Drops the tasks left, by the drain's owner once the pool stopped.
+        // Their futures report a broken promise.
+        void cancel()
+        {
+            do
+            {
+                while (Task * task = pop())
+                {
+                    dropTask(task);
+                }
+            }
+            while (!release());
+        }
+
+        ThreadPool *        pool;
+        Stub                stub;
+        std::atomic<Task *> tail;
+        Task *              head;
+        std::atomic<bool>   scheduled;
+    };
+
+    struct StrandTask : Task
+    {
+        explicit StrandTask(std::shared_ptr<StrandQueue> && strand)
+            : strand(std::move(strand))
+        {}
+
+        void run() override
+        {
+            drain(*strand);
+        }
+
+        // Dropped along with the pool's tasks, so are the strand's
+        void cancel() override
+        {
+            strand->cancel();
+        }
+
+        std::shared_ptr<StrandQueue> strand;
+    };
+
+    // Fields are grouped by who writes them, each group on its own cache
+    // lines, so producers don't invalidate what sleeping workers read
+    struct Shared
+    {
+        // Read mostly, only written when starting and stopping
+        std::atomic<bool>       run;
+        std::atomic<bool>       paused;
+        TaskHeaps               heaps;  // Outlive the tasks in the queues
+        Queues                  queues;
+        LocalQueues             locals; // One per worker
+        Mailboxes               mailboxes; // One per worker
+        WorkersCounters         counters; // One per worker
+        std::atomic<size_t>     active; // Workers from this id on are parked
+        std::atomic<size_t>     blocked; // Workers in blocking(), unparking as many
+        std::atomic<bool>       tracing;
+        TraceBuffers            traces;
+        Clock::time_point       epoch;
+#ifdef THREAD_POOL_HAS_IO_URING
+        std::unique_ptr<IoRing> ringOwner; // Created on first use
+        std::atomic<IoRing *>   ring;
+        bool                    ringFailed;
+#endif
+#ifdef THREAD_POOL_HAS_EVENTFD
+        std::atomic<int>        completions; // Signaled when tasks finish, created on first use
+#endif
+
+        // Tasks in all the queues, and tasks either queued or running,
+        // written by every producer and worker
+        alignas(THREAD_POOL_CACHE_LINE_SIZE) std::atomic<size_t> pending;
+        std::atomic<size_t>     unfinished;
+
+        // Read by every producer, written by workers going to sleep
+        alignas(THREAD_POOL_CACHE_LINE_SIZE) std::atomic<size_t> idle; // Workers and helpers
+        std::atomic<size_t>     idleHelpers;
+        ParkingLot              lot; // Where idle workers sleep
+
+        // Read by every worker finishing a task, written by waitIdle callers
+        std::atomic<size_t>     waiters;
+#ifdef THREAD_POOL_HAS_EVENTFD
+        std::atomic<bool>       signaled; // Until the completions are acknowledged
+#endif
+
+#ifdef THREAD_POOL_HAS_IO_URING
+        // I/O submitted and not reaped yet, and whether a worker is waiting
+        // for completions (instead of sleeping on the condition variable)
+        std::atomic<size_t>     inflight;
+        std::atomic<bool>       polling;
+#endif
+
+        // Guards the workers' state changes, and helpers sleeping
+        alignas(THREAD_POOL_CACHE_LINE_SIZE) std::mutex mutex;
+        std::condition_variable cond;    // Where idle helpers sleep
+        std::condition_variable drained; // Signaled when going idle
+        std::condition_variable parked;  // Signaled when activating workers
+        std::atomic<bool>       exit;
+        Helpers                 helpers; // Joined when spawning more and when stopping
+        std::atomic<size_t>     wanted;  // Helpers wanted taking tasks, one per uncompensated blocked worker
+        std::atomic<size_t>     helping; // Helpers taking tasks
+        size_t                  spares;  // Helpers kept for the next blocked workers
+        std::condition_variable spare;   // Where spare helpers sleep
+        std::atomic<uint64_t>   helped;  // Tasks run by helpers
+
+        // Written by executors' producers and the workers taking their tasks
+        alignas(THREAD_POOL_CACHE_LINE_SIZE) Flows flows;
+
+#ifdef THREAD_POOL_HAS_IO_URING
+        // Written when watching fds and by the worker handling their events
+        alignas(THREAD_POOL_CACHE_LINE_SIZE) Watches watches;
+#endif
+    };
+
+    enum class Affinity
+    {
+        NONE,
+        PINNED,   // Only run by the worker
+        PREFERRED // Run by the worker, unless idle ones steal it first
+    };
+
+    // Where a task is queued: an executor's queue, a worker's mailbox, or
+    // the pool's own queues
+    struct Target
+    {
+        Target(Flow * flow = nullptr)
+            : flow(flow), affinity(Affinity::NONE), worker(0), strand(nullptr)
+        {}
+
+        Target(Affinity affinity, size_t worker)
+            : flow(nullptr), affinity(affinity), worker(worker), strand(nullptr)
+        {}
+
+        explicit Target(StrandQueue & strand)
+            : flow(nullptr), affinity(Affinity::NONE), worker(0), strand(&strand)
+        {}
+
+        Flow *        flow;
+        Affinity      affinity;
+        size_t        worker;
+        StrandQueue * strand;
+    };
+
+    // Identifies the pool and worker the current thread belongs to, if any
+    struct Context
+    {
+        Shared * shared;
+        size_t   id;
+    };
+
+    static constexpr const char * DEFAULT_TRACE_CATEGORY = "task";
+
+private:
+    static Context & context()
+    {
+        static thread_local Context ctx = { nullptr, 0 };
+        return ctx;
+    }
+
+    // Stops accepting tasks, returns false if the pool wasn't running
+    bool close()
+    {
+        disableAutoTuning();
+
+        {
+            std::lock_guard<std::mutex> guard(_shared.mutex);
+
+            // Not running, do nothing
+            if (!_shared.run)
+            {
+                return false;
+            }
+
+            _shared.run = false;
+        }
+
+        // Every producer that saw the pool running has finished pushing once
+        // we got hold of its queue, so the pending count is final afterwards
+        for (std::unique_ptr<Queue> & queue : _shared.queues)
+        {
+            std::lock_guard<std::mutex> guard(queue->mutex);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(_shared.flows.mutex);
+        }
+
+        for (std::unique_ptr<Mailbox> & mailbox : _shared.mailboxes)
+        {
+            std::lock_guard<std::mutex> guard(mailbox->mutex);
+        }
+
+#ifdef THREAD_POOL_HAS_IO_URING
+        if (IoRing * ring = _shared.ring)
+        {
+            ring->barrier();
+
+            // A worker waiting for watched fds stops waiting for them
+            if (_shared.polling)
+            {
+                ring->wake();
+            }
+        }
+#endif
+
+        return true;
+    }
+
+    // Destroys the tasks still queued, breaking their promises
+    void drop()
+    {
+        for (std::unique_ptr<Queue> & queue : _shared.queues)
+        {
+            std::lock_guard<std::mutex> guard(queue->mutex);
+
+            size_t count = queue->tasks.size();
+            _shared.pending -= count;
+
+            for (Task * task : queue->tasks)
+            {
+                dropTask(task);
+            }
+            queue->tasks.clear();
+
+            finished(_shared, count);
+        }
+
+        for (std::unique_ptr<LocalQueue> & local : _shared.locals)
+        {
+            while (Task * task = local->steal())
+            {
+                dropTask(task);
+                _shared.pending--;
+                finished(_shared);
+            }
+        }
+
+        for (std::unique_ptr<Mailbox> & mailbox : _shared.mailboxes)
+        {
+            std::lock_guard<std::mutex> guard(mailbox->mutex);
+
+            size_t count = mailbox->pinned.size() + mailbox->preferred.size();
+            _shared.pending -= mailbox->preferred.size();
+            mailbox->pinnedCount = 0;
+            mailbox->preferredCount = 0;
+
+            for (Task * task : mailbox->pinned)
+            {
+                dropTask(task);
+            }
+            mailbox->pinned.clear();
+
+            for (Task * task : mailbox->preferred)
+            {
+                dropTask(task);
+            }
+            mailbox->preferred.clear();
+
+            finished(_shared, count);
+        }
+
+        std::lock_guard<std::mutex> guard(_shared.flows.mutex);
+
+        for (std::unique_ptr<Flow> & flow : _shared.flows.all)
+        {
+            size_t count = flow->tasks.size();
+
+            if (flow->counted())
+            {
+                _shared.flows.runnable -= count;
+                _shared.pending -= count;
+            }
+
+            for (Task * task : flow->tasks)
+            {
+                dropTask(task);
+            }
+            flow->tasks.clear();
+
+            finished(_shared, count);
+        }
+    }
+
+    void join()
+    {
+        {
+            std::lock_guard<std::mutex> guard(_shared.mutex);
+
+            // What's left of the backlog is drained, paused or not
+            _shared.paused = false;
+            _shared.active = _shared.locals.size();
+            _shared.exit = true;
+            wakeAll(_shared);
+            _shared.parked.notify_all();
+        }
+
+        for (Worker & w : _workers)
+        {
+            w.join();
+        }
+
+        // Helpers leave once the queues are empty too, and no worker is left
+        // to spawn more
+        Helpers helpers;
+
+        {
+            std::lock_guard<std::mutex> guard(_shared.mutex);
+            helpers.swap(_shared.helpers);
+        }
+
+        for (Helper & helper : helpers)
+        {
+            if (helper.thread.joinable())
+            {
+                helper.thread.join();
+            }
+        }
+    }
+
+    // Counts a thread waiting for the pool to go idle, so workers only
+    // bother notifying when someone is waiting
+    class WaiterGuard
+    {
+    public:
+        explicit WaiterGuard(Shared & shared)
+            : _shared(shared)
+        {
+            _shared.waiters++;
+        }
+
+        ~WaiterGuard()
+        {
+            _shared.waiters--;
+        }
+
+    private:
+        Shared & _shared;
+    };
+
+    uint64_t completed() const
+    {
+        uint64_t total = _shared.helped.load(std::memory_order_relaxed);
+
+        for (const std::unique_ptr<Counters> & counters : _shared.counters)
+        {
+            total += counters->completed.load(std::memory_order_relaxed);
+        }
+
+        return total;
+    }
+
+    void setActive(size_t active)
+    {
+        std::lock_guard<std::mutex> guard(_shared.mutex);
+
+        // Idle workers beyond the new count move over to the parked ones
+        _shared.active = active;
+        wakeAll(_shared);
+        _shared.parked.notify_all();
+    }
+
+    // Hill climbing over the active workers count, one worker at a time
+    void tune()
+    {
+        std::unique_lock<std::mutex> lock(_tuner.mutex);
+
+        Clock::time_point lastTime = Clock::now();
+        uint64_t lastCompleted = completed();
+        double lastThroughput = 0;
+        int direction = 1;
+
+        while (!_tuner.cond.wait_for(lock, _tuner.interval, [this](){ return !_tuner.run; }))
+        {
+            Clock::time_point now = Clock::now();
+            uint64_t total = completed();
+
+            double seconds = std::chrono::duration<double>(now - lastTime).count();
+            double throughput = seconds > 0 ? (total - lastCompleted) / seconds : 0;
+
+            size_t active = _shared.active;
+            size_t next = active;
+
+            if (_shared.pending == 0)
+            {
+                // Nothing waiting, spare workers would only sit idle
+                direction = -1;
+                next = active - 1;
+            }
+            else
+            {
+                // The last move made things worse (beyond noise), go back
+                if (throughput < lastThroughput * 0.95)
+                {
+                    direction = -direction;
+                }
+
+                next = direction > 0 ? active + 1 : active - 1;
+            }
+
+            next = std::max(std::min(next, _tuner.max), _tuner.min);
+
+            if (next != active)
+            {
+                setActive(next);
+                _tuner.adjustments++;
+            }
+
+            _tuner.throughput = throughput;
+
+            lastTime = now;
+            lastCompleted = total;
+            lastThroughput = throughput;
+        }
+    }
+
+    // Counts a worker as blocked for its lifetime. That unparks a worker if
+    // any is parked, otherwise compensate() gets a helper thread going.
+    class BlockingGuard
+    {
+    public:
+        explicit BlockingGuard(Shared & shared)
+            : _shared(shared), _helper(false)
+        {
+            std::lock_guard<std::mutex> guard(_shared.mutex);
+
+            _shared.blocked++;
+            _parked = _shared.active + _shared.blocked <= _shared.locals.size();
+
+            if (_parked)
+            {
+                _shared.parked.notify_all();
+            }
+        }
+
+        ~BlockingGuard()
+        {
+            std::lock_guard<std::mutex> guard(_shared.mutex);
+
+            _shared.blocked--;
+
+            // One of the helpers steps down
+            if (_helper)
+            {
+                _shared.wanted--;
+                _shared.cond.notify_all();
+            }
+        }
+
+        void compensate()
+        {
+            if (_parked)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> guard(_shared.mutex);
+
+            _shared.wanted++;
+            _helper = true;
+
+            enlist(_shared);
+        }
+
+    private:
+        Shared & _shared;
+        bool     _parked;
+        bool     _helper;
+    };
+
+    // Stops the pool unless dismissed, e.g. when failing to start it
+    class StopGuard
+    {
+    public:
+        explicit StopGuard(ThreadPool & pool)
+            : _pool(&pool)
+        {}
+
+        ~StopGuard()
+        {
+            if (_pool)
+            {
+                _pool->stop(true);
+            }
+        }
+
+        void dismiss()
+        {
+            _pool = nullptr;
+        }
+
+    private:
+        ThreadPool * _pool;
+    };
+
+    // Destroys a task unless released, e.g. when failing to queue it
+    class TaskGuard
+    {
+    public:
+        explicit TaskGuard(Task * task)
+            : _task(task)
+        {}
+
+        ~TaskGuard()
+        {
+            if (_task)
+            {
+                destroyTask(_task);
+            }
+        }
+
+        Task * release()
+        {
+            Task * task = _task;
+            _task = nullptr;
+            return task;
+        }
+
+    private:
+        Task * _task;
+    };
+
+    void create(size_t size, size_t queues, MemoryResource * resource)
+    {
+        _shared.run = false;
+        _shared.paused = false;
+        _shared.exit = false;
+        _shared.pending = 0;
+        _shared.unfinished = 0;
+        _shared.idle = 0;
+        _shared.idleHelpers = 0;
+        _shared.waiters = 0;
+        _shared.active = size;
+        _shared.blocked = 0;
+#ifdef THREAD_POOL_HAS_IO_URING
+        _shared.ring = nullptr;
+        _shared.ringFailed = false;
+        _shared.inflight = 0;
+        _shared.polling = false;
+        _shared.watches.epoll = -1;
+        _shared.watches.armed = false;
+        _shared.watches.count = 0;
+#endif
+#ifdef THREAD_POOL_HAS_EVENTFD
+        _shared.completions = -1;
+        _shared.signaled = false;
+#endif
+        _shared.wanted = 0;
+        _shared.helping = 0;
+        _shared.spares = 0;
+        _shared.helped = 0;
+        _shared.tracing = false;
+        _shared.epoch = Clock::now();
+
+        queues = queues ? queues : size;
+        for (size_t i = 0; i < (queues ? queues : 1); i++)
+        {
+            _shared.queues.emplace_back(new Queue());
+        }
+
+        for (size_t id = 0; id < size; id++)
+        {
+            _shared.locals.emplace_back(new LocalQueue());
+            _shared.mailboxes.emplace_back(new Mailbox());
+            _shared.counters.emplace_back(new Counters());
+        }
+        _shared.lot.resize(size);
+
+        // A heap per worker, then a heap per queue for outside producers
+        for (size_t i = 0; i < size + _shared.queues.size(); i++)
+        {
+            _shared.heaps.emplace_back(new TaskHeap(i >= size, resource));
+        }
+
+        start();
+    }
+
+    template < class Func, class... Args >
+    auto addTargetedTask(Target target, Func&& func, Args&&... args)
+        -> std::future<TaskResult<Func, Args...>>
+    {
+        std::error_code ec;
+
+        auto result = submit(ec, target, DEFAULT_TRACE_CATEGORY, std::forward<Func>(func), std::forward<Args>(args)...);
+
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+        if (ec)
+        {
+            throw std::runtime_error("Can't add tasks when not running");
+        }
+#endif
+
+        return result;
+    }
+
+    template < class Func, class... Args >
+    auto submit(std::error_code & ec, Target target, const char * category, Func&& func, Args&&... args)
+        -> std::future<TaskResult<Func, Args...>>
+    {
+        using result_type = TaskResult<Func, Args...>;
+        using callable_type = Callable<typename std::decay<Func>::type, typename std::decay<Args>::type...>;
+
+        ec.clear();
+
+        const std::shared_ptr<TaskHeap> & heap = currentHeap();
+
+        std::promise<result_type> promise(std::allocator_arg, HeapAllocator<result_type>(heap));
+        auto result = promise.get_future();
+
+        bool queued = enqueue(makeTask<BoundTask<result_type, callable_type>>(*heap,
+                                  callable_type(Forward(), std::forward<Func>(func), std::forward<Args>(args)...), std::move(promise)),
+                              category, target);
+
+        if (!queued)
+        {
+            ec = std::make_error_code(std::errc::operation_not_permitted);
+            return std::future<result_type>();
+        }
+
+        return result;
+    }
+
+#ifdef THREAD_POOL_HAS_IO_URING
+    template < class Func >
+    auto submitIo(uint8_t opcode, int fd, void * buffer, size_t size, uint64_t offset, Func&& then)
+        -> std::future<TaskResult<Func, ssize_t>>
+    {
+        using result_type = TaskResult<Func, ssize_t>;
+        using callable_type = Callable<typename std::decay<Func>::type, ssize_t>;
+        using task_type = IoTask<result_type, callable_type>;
+
+        const std::shared_ptr<TaskHeap> & heap = currentHeap();
+
+        std::promise<result_type> promise(std::allocator_arg, HeapAllocator<result_type>(heap));
+        auto result = promise.get_future();
+
+        task_type * task = static_cast<task_type *>(makeTask<task_type>(*heap,
+                               callable_type(Forward(), std::forward<Func>(then), ssize_t(0)),
+                               std::move(promise), opcode, fd, buffer, size, offset));
+
+        IoRing * ring = ioRing();
+
+        bool queued = ring
+            ? submitRing(*ring, task, opcode, fd, &task->iov, offset)
+            : enqueue(task, DEFAULT_TRACE_CATEGORY);
+
+        if (!queued)
+        {
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+            throw std::runtime_error("Can't add tasks when not running");
+#else
+            return std::future<result_type>();
+#endif
+        }
+
+        return result;
+    }
+
+    // Takes ownership of the task, returns false when not running
+    bool submitRing(IoRing & ring, Task * task, uint8_t opcode, int fd, const struct iovec * iov, uint64_t offset)
+    {
+        TaskGuard guard(task);
+
+        // Counted before submitting, it may complete right away
+        int error = ring.submit(opcode, fd, iov, offset, reinterpret_cast<uint64_t>(task), [this]() {
+            if (!_shared.run)
+            {
+                return false;
+            }
+
+            _shared.unfinished++;
+            _shared.inflight++;
+            return true;
+        });
+
+        if (error > 0)
+        {
+            return false;
+        }
+
+        guard.release();
+
+        if (error)
+        {
+            task->complete(error);
+            schedule(_shared, task);
+            _shared.inflight--;
+            finished(_shared);
+            return true;
+        }
+
+        // Make sure some worker waits for the completion
+        if (!_shared.polling && _shared.idle > 0)
+        {
+            wakeOne(_shared);
+        }
+
+        return true;
+    }
+
+    IoRing * ioRing()
+    {
+        IoRing * ring = _shared.ring.load(std::memory_order_acquire);
+
+        if (ring)
+        {
+            return ring;
+        }
+
+        std::lock_guard<std::mutex> guard(_shared.mutex);
+
+        if (!_shared.ring && !_shared.ringFailed)
+        {
+            _shared.ringOwner.reset(IoRing::create());
+            _shared.ringFailed = !_shared.ringOwner;
+            _shared.ring.store(_shared.ringOwner.get(), std::memory_order_release);
+        }
+
+        return _shared.ring;
+    }
+
+    // Queues a task whose I/O completed. Doesn't check the pool is running,
+    // a stopping pool still finishes the I/O that was in flight.
+    static void schedule(Shared & shared, Task * task)
+    {
+        Context & ctx = context();
+
+        shared.unfinished++;
+
+        if (ctx.shared == &shared && shared.locals[ctx.id]->push(task))
+        {
+            shared.pending++;
+        }
+        else
+        {
+            Queue & queue = *shared.queues[producerSlot() % shared.queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+
+            queue.tasks.push_back(task);
+            shared.pending++;
+        }
+
+        if (shared.idle > 0)
+        {
+            wakeOne(shared);
+        }
+        else
+        {
+            makeUp(shared);
+        }
+    }
+
+    // Schedules the tasks whose I/O completed, and the handlers of the
+    // watched fds that are ready. Completions reaped by another worker while
+    // one waits for them would leave it waiting for nothing, so it's woken.
+    static void reapRing(Shared & shared, IoRing & ring, bool poller)
+    {
+        size_t reaped = ring.reap([&shared, &ring](uint64_t data, ssize_t result) {
+            if (data == reinterpret_cast<uint64_t>(&shared.watches))
+            {
+                dispatch(shared, ring);
+            }
+            else if (Task * task = reinterpret_cast<Task *>(data))
+            {
+                // The kernel orders the submission before its completion, but
+                // the memory model only sees the submitter's increment
+                shared.inflight.load(std::memory_order_acquire);
+
+                task->complete(result);
+                schedule(shared, task);
+                shared.inflight--;
+                finished(shared);
+            }
+        });
+
+        if (reaped && !poller && shared.polling)
+        {
+            ring.wake();
+        }
+    }
+
+    // Polls the epoll instance through the ring, called with the watches' lock
+    static void arm(Shared & shared, IoRing & ring)
+    {
+        Watches & watches = shared.watches;
+
+        watches.armed = ring.submit(IORING_OP_POLL_ADD, watches.epoll, nullptr, 0,
+                                    reinterpret_cast<uint64_t>(&watches), [](){ return true; },
+                                    POLLIN) == 0;
+    }
+
+    // Schedules a task per ready fd and polls again, unless stopped (the
+    // pool polls again once started)
+    static void dispatch(Shared & shared, IoRing & ring)
+    {
+        Watches & watches = shared.watches;
+        std::lock_guard<std::mutex> guard(watches.mutex);
+
+        watches.armed = false;
+
+        if (!shared.run)
+        {
+            return;
+        }
+
+        struct epoll_event events[Watches::BATCH];
+        int count = ::epoll_wait(watches.epoll, events, Watches::BATCH, 0);
+
+        for (int i = 0; i < count; i++)
+        {
+            // Copied out, epoll_event may be packed
+            int fd = events[i].data.fd;
+            uint32_t ready = events[i].events;
+
+            auto it = watches.all.find(fd);
+            if (it == watches.all.end())
+            {
+                continue; // Unwatched meanwhile
+            }
+
+            Task * task = makeTask<WatchTask>(*currentHeap(shared), watches, it->second, ready);
+            schedule(shared, task);
+        }
+
+        arm(shared, ring);
+    }
+#endif
+
+    // Takes ownership of the task, returns false when not running
+    bool enqueue(Task * task, const char * category, Target target = Target())
+    {
+        TaskGuard guard(task);
+
+        if (_shared.tracing.load(std::memory_order_relaxed))
+        {
+            task->category = category;
+            task->submitted = Clock::now();
+        }
+
+        if (target.flow)
+        {
+            if (!enqueueFlow(task, *target.flow))
+            {
+                return false;
+            }
+
+            guard.release();
+        }
+        else if (target.strand)
+        {
+            guard.release();
+            return enqueueStrand(task, *target.strand);
+        }
+        else if (target.affinity != Affinity::NONE && !_shared.mailboxes.empty())
+        {
+            guard.release();
+            return enqueueMailbox(task, target.affinity, target.worker % _shared.mailboxes.size());
+        }
+        else if (enqueueLocal(task))
+        {
+            guard.release();
+        }
+        else
+        {
+            Queue & queue = *_shared.queues[producerSlot() % _shared.queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+
+            if (!_shared.run)
+            {
+                return false;
+            }
+
+            queue.tasks.push_back(task);
+            guard.release();
+
+            _shared.unfinished++;
+            _shared.pending++;
+        }
+
+        // Pairs with the idle count a worker publishes before it re-checks the
+        // pending count, one of the two is bound to see the other.
+        // Idle workers are woken for local tasks too, in case the owner blocks.
+        if (_shared.idle > 0)
+        {
+            wakeOne(_shared);
+        }
+#ifdef THREAD_POOL_HAS_IO_URING
+        else if (_shared.polling)
+        {
+            _shared.ring.load()->wake();
+        }
+#endif
+        else
+        {
+            makeUp(_shared);
+        }
+
+        return true;
+    }
+
+    // Takes ownership of the task, returns false when not running. A task
+    // added as the pool stops is dropped, its future reporting a broken
+    // promise.
+    bool enqueueStrand(Task * task, StrandQueue & strand)
+    {
+        TaskGuard guard(task);
+
+        if (!_shared.run)
+        {
+            return false;
+        }
+
+        strand.push(guard.release());
+
+        // Pairs with the drain clearing the flag, then checking for tasks.
+        // Stopped since checking above, the task is dropped like the ones
+        // queued when stopping.
+        if (!strand.scheduled.exchange(true) && !scheduleStrand(strand))
+        {
+            strand.cancel();
+        }
+
+        return true;
+    }
+
+    bool scheduleStrand(StrandQueue & strand)
+    {
+        return enqueue(makeTask<StrandTask>(*currentHeap(), strand.shared_from_this()),
+                       DEFAULT_TRACE_CATEGORY);
+    }
+
+    // Runs a batch of the strand's tasks, then schedules itself again if
+    // there are more, or drains the rest in place when the pool is stopping
+    static void drain(StrandQueue & strand)
+    {
+        Shared & shared = strand.pool->_shared;
+
+        while (true)
+        {
+            for (size_t i = 0; i < StrandQueue::BATCH; i++)
+            {
+                Task * task = strand.pop();
+
+                if (!task)
+                {
+                    break;
+                }
+
+                if (!task->category)
+                {
+                    task->run();
+                }
+                else
+                {
+                    Clock::time_point begin = Clock::now();
+                    task->run();
+                    record(shared, task->category, task->submitted, begin, Clock::now());
+                }
+
+                destroyTask(task);
+            }
+
+            if (strand.release() || strand.pool->scheduleStrand(strand))
+            {
+                return;
+            }
+        }
+    }
+
+    // Takes ownership of the task, returns false when not running
+    bool enqueueMailbox(Task * task, Affinity affinity, size_t worker)
+    {
+        TaskGuard guard(task);
+        Mailbox & mailbox = *_shared.mailboxes[worker];
+
+        {
+            std::lock_guard<std::mutex> lock(mailbox.mutex);
+
+            if (!_shared.run)
+            {
+                return false;
+            }
+
+            _shared.unfinished++;
+
+            if (affinity == Affinity::PINNED)
+            {
+                mailbox.pinned.push_back(guard.release());
+                mailbox.pinnedCount++;
+            }
+            else
+            {
+                mailbox.preferred.push_back(guard.release());
+                mailbox.preferredCount++;
+                _shared.pending++;
+            }
+        }
+
+        // The worker itself if it's sleeping. Otherwise a preferred task goes
+        // to an idle worker rather than waiting, a pinned one has to wait.
+        if (_shared.lot.unpark(worker))
+        {
+            return true;
+        }
+
+        if (affinity == Affinity::PINNED)
+        {
+            // Loads in order with the count pushed above, like shouldWake()
+            if (worker >= _shared.active + _shared.blocked)
+            {
+                std::lock_guard<std::mutex> lock(_shared.mutex);
+                _shared.parked.notify_all();
+            }
+#ifdef THREAD_POOL_HAS_IO_URING
+            // The worker may be the one waiting for the ring
+            else if (_shared.polling)
+            {
+                _shared.ring.load()->wake();
+            }
+#endif
+        }
+        else if (_shared.idle > 0)
+        {
+            wakeOne(_shared);
+        }
+#ifdef THREAD_POOL_HAS_IO_URING
+        else if (_shared.polling)
+        {
+            _shared.ring.load()->wake();
+        }
+#endif
+        else
+        {
+            makeUp(_shared);
+        }
+
+        return true;
+    }
+
+    bool enqueueFlow(Task * task, Flow & flow)
+    {
+        Flows & flows = _shared.flows;
+        std::lock_guard<std::mutex> lock(flows.mutex);
+
+        if (!_shared.run)
+        {
+            return false;
+        }
+
+        flow.tasks.push_back(task);
+        task->flow = &flow;
+        flow.submitted++;
+
+        _shared.unfinished++;
+
+        if (flow.counted())
+        {
+            flows.link(flow);
+            flows.runnable++;
+            _shared.pending++;
+        }
+
+        return true;
+    }
+
+    // Tasks submitted by one of our own workers go to its local queue, which
+    // it drains first while the data is still in cache. Left for the shared
+    // queues when full, or when not running so they report it.
+    bool enqueueLocal(Task * task)
+    {
+        Context & ctx = context();
+
+        if (ctx.shared != &_shared || !_shared.run)
+        {
+            return false;
+        }
+
+        // Counted before pushing, a thief may finish the task right away
+        _shared.unfinished++;
+
+        if (!_shared.locals[ctx.id]->push(task))
+        {
+            finished(_shared);
+            return false;
+        }
+
+        _shared.pending++;
+
+        return true;
+    }
+
+    // Workers allocate from their own heap, outside producers from the heap
+    // matching their queue
+    const std::shared_ptr<TaskHeap> & currentHeap()
+    {
+        return currentHeap(_shared);
+    }
+
+    static const std::shared_ptr<TaskHeap> & currentHeap(Shared & shared)
+    {
+        Context & ctx = context();
+
+        if (ctx.shared == &shared)
+        {
+            return shared.heaps[ctx.id];
+        }
+
+        return shared.heaps[shared.locals.size() + producerSlot() % shared.queues.size()];
+    }
+
+    template < class T, class... Params >
+    static Task * makeTask(TaskHeap & heap, Params&&... params)
+    {
+        std::unique_ptr<void, void (*)(void *)> block(heap.allocate(sizeof(T), alignof(T)), TaskHeap::deallocate);
+
+        Task * task = new (block.get()) T(std::forward<Params>(params)...);
+        block.release();
+
+        return task;
+    }
+
+    static void destroyTask(Task * task)
+    {
+        task->~Task();
+        TaskHeap::deallocate(task);
+    }
+
+    static void dropTask(Task * task)
+    {
+        task->cancel();
+        destroyTask(task);
+    }
+
+    template < class Result, class Function >
+    static void fulfill(std::promise<Result> & promise, Function & callable)
+    {
+        promise.set_value(callable());
+    }
+
+    template < class Function >
+    static void fulfill(std::promise<void> & promise, Function & callable)
+    {
+        callable();
+        promise.set_value();
+    }
+
+    // Hands out consecutive numbers to threads, spreading producers evenly
+    // across the queues (std::thread::id hashes to aligned addresses)
+    static size_t producerSlot()
+    {
+        static std::atomic<size_t> next(0);
+        static thread_local size_t slot = next++;
+        return slot;
+    }
+
+    // Counts the task in the worker's counters, helpers have none
+    static void execute(Shared & shared, Task * task, Counters * counters)
+    {
+        Flow * flow = task->flow;
+
+        if (!task->category)
+        {
+            task->run();
+        }
+        else
+        {
+            Clock::time_point begin = Clock::now();
+            task->run();
+            record(shared, task->category, task->submitted, begin, Clock::now());
+        }
+
+        destroyTask(task);
+
+        if (flow)
+        {
+            flowFinished(shared, *flow);
+        }
+
+        // Only written by the worker owning the counters
+        if (counters)
+        {
+            counters->completed.store(counters->completed.load(std::memory_order_relaxed) + 1,
+                                      std::memory_order_relaxed);
+        }
+        else
+        {
+            shared.helped.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        finished(shared);
+    }
+
+    // Once below its limit again, an executor's queued tasks are counted
+    // back, the calling worker is awake to take them
+    static void flowFinished(Shared & shared, Flow & flow)
+    {
+        Flows & flows = shared.flows;
+        std::lock_guard<std::mutex> lock(flows.mutex);
+
+        bool limited = !flow.counted();
+
+        flow.running--;
+        flow.completed++;
+
+        if (limited && !flow.tasks.empty())
+        {
+            flows.runnable += flow.tasks.size();
+            shared.pending += flow.tasks.size();
+            flows.link(flow);
+        }
+    }
+
+    // Counts finished (or dropped) tasks, waking waitIdle callers once none
+    // are left. Pairs with the waiters count published before they check
+    // the unfinished count, one of the two is bound to see the other.
+    static void finished(Shared & shared, size_t count = 1)
+    {
+        if (count && shared.unfinished.fetch_sub(count) == count && shared.waiters > 0)
+        {
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            shared.drained.notify_all();
+        }
+
+#ifdef THREAD_POOL_HAS_EVENTFD
+        // Only the first task finishing since the last acknowledgement writes
+        int fd = shared.completions.load(std::memory_order_relaxed);
+        if (count && fd >= 0 && !shared.signaled.exchange(true))
+        {
+            uint64_t one = 1;
+            ssize_t bytes = ::write(fd, &one, sizeof(one));
+            (void)bytes;
+        }
+#endif
+    }
+
+    static void record(Shared & shared, const char * category,
+                       Clock::time_point submitted, Clock::time_point begin, Clock::time_point end)
+    {
+        Context & ctx = context();
+
+        if (ctx.shared != &shared || ctx.id >= shared.traces.size())
+        {
+            return;
+        }
+
+        TraceBuffer & buffer = *shared.traces[ctx.id];
+        std::lock_guard<std::mutex> guard(buffer.mutex);
+
+        TraceEvent & event = buffer.events[buffer.next];
+        event.category  = category;
+        event.submitted = submitted;
+        event.begin     = begin;
+        event.end       = end;
+
+        if (++buffer.next == buffer.events.size())
+        {
+            buffer.next = 0;
+            buffer.wrapped = true;
+        }
+    }
+
+    static long long micros(Clock::duration d)
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    }
+
+    long long sinceEpoch(Clock::time_point tp) const
+    {
+        return micros(tp - _shared.epoch);
+    }
+
+    static void writeEscaped(std::ostream & out, const char * str)
+    {
+        for (; *str; str++)
+        {
+            if (*str == '"' || *str == '\\')
+            {
+                out << '\\';
+            }
+            out << *str;
+        }
+    }
+
+    // Try the local queue and the mailbox first, then the submission queues
+    // and the executors' queues, taking turns at which comes first, and
+    // finally steal from the other workers
+    static Task * dequeue(size_t id, Shared & shared, bool flowsFirst)
+    {
+        if (Task * task = takeLocal(shared.locals[id]->pop(), shared))
+        {
+            return task;
+        }
+
+        if (Task * task = dequeueMailbox(*shared.mailboxes[id], shared, true))
+        {
+            return task;
+        }
+
+        if (flowsFirst)
+        {
+            if (Task * task = dequeueFlow(shared))
+            {
+                return task;
+            }
+        }
+
+        if (Task * task = dequeueQueue(id, shared))
+        {
+            return task;
+        }
+
+        if (!flowsFirst)
+        {
+            if (Task * task = dequeueFlow(shared))
+            {
+                return task;
+            }
+        }
+
+        size_t count = shared.locals.size();
+
+        for (size_t i = 1; i < count && shared.pending > 0; i++)
+        {
+            if (Task * task = takeLocal(shared.locals[(id + i) % count]->steal(), shared))
+            {
+                return task;
+            }
+        }
+
+        for (size_t i = 1; i < count && shared.pending > 0; i++)
+        {
+            if (Task * task = dequeueMailbox(*shared.mailboxes[(id + i) % count], shared, false))
+            {
+                return task;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // The owner takes its pinned tasks first, others only preferred ones.
+    // The counts are checked first, so empty mailboxes cost no locking.
+    static Task * dequeueMailbox(Mailbox & mailbox, Shared & shared, bool owner)
+    {
+        bool pinned = owner && mailbox.pinnedCount > 0;
+
+        if (!pinned && mailbox.preferredCount == 0)
+        {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> guard(mailbox.mutex);
+
+        if (pinned && !mailbox.pinned.empty())
+        {
+            Task * task = mailbox.pinned.front();
+            mailbox.pinned.pop_front();
+            mailbox.pinnedCount--;
+            return task;
+        }
+
+        if (!mailbox.preferred.empty())
+        {
+            Task * task = mailbox.preferred.front();
+            mailbox.preferred.pop_front();
+            mailbox.preferredCount--;
+            shared.pending--;
+            return task;
+        }
+
+        return nullptr;
+    }
+
+    // Only the worker takes these, parked by auto-tuning or not
+    static Task * dequeuePinned(size_t id, Shared & shared)
+    {
+        Mailbox & mailbox = *shared.mailboxes[id];
+
+        if (mailbox.pinnedCount == 0)
+        {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> guard(mailbox.mutex);
+
+        if (mailbox.pinned.empty())
+        {
+            return nullptr;
+        }
+
+        Task * task = mailbox.pinned.front();
+        mailbox.pinned.pop_front();
+        mailbox.pinnedCount--;
+        return task;
+    }
+
+    static bool hasPinned(const Shared & shared, size_t id)
+    {
+        return shared.mailboxes[id]->pinnedCount > 0;
+    }
+
+    // The home queue first, then scan the other queues
+    static Task * dequeueQueue(size_t id, Shared & shared)
+    {
+        size_t count = shared.queues.size();
+
+        for (size_t i = 0; i < count && shared.pending > 0; i++)
+        {
+            Queue & queue = *shared.queues[(id + i) % count];
+            std::lock_guard<std::mutex> guard(queue.mutex);
+
+            if (!queue.tasks.empty())
+            {
+                Task * task = queue.tasks.front();
+                queue.tasks.pop_front();
+                shared.pending--;
+                return task;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Deficit round robin, every task costs the same: the executor at the
+    // head gets 'weight' tasks per round before moving to the back
+    static Task * dequeueFlow(Shared & shared)
+    {
+        Flows & flows = shared.flows;
+
+        if (flows.runnable == 0)
+        {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(flows.mutex);
+
+        while (flows.head)
+        {
+            Flow & flow = *flows.head;
+
+            if (flow.tasks.empty() || !flow.counted())
+            {
+                flows.unlinkHead();
+                continue;
+            }
+
+            if (flow.deficit == 0)
+            {
+                flow.deficit = flow.weight;
+            }
+
+            Task * task = flow.tasks.front();
+            flow.tasks.pop_front();
+            flow.deficit--;
+            flow.running++;
+
+            flows.runnable--;
+            shared.pending--;
+
+            // Reached its limit, the rest wait for one of its tasks to finish
+            if (!flow.counted())
+            {
+                flows.runnable -= flow.tasks.size();
+                shared.pending -= flow.tasks.size();
+            }
+
+            if (flow.tasks.empty() || !flow.counted())
+            {
+                flows.unlinkHead();
+            }
+            else if (flow.deficit == 0)
+            {
+                flows.head = flow.next;
+            }
+
+            return task;
+        }
+
+        return nullptr;
+    }
+
+    // Wakes a sleeping worker, or a sleeping helper when no worker sleeps.
+    // Pairs with the idle count a thread publishes before it re-checks for
+    // work, one of the two is bound to see the other.
+    static void wakeOne(Shared & shared)
+    {
+        if (shared.lot.unparkOne())
+        {
+            return;
+        }
+
+        if (shared.idleHelpers > 0)
+        {
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            shared.cond.notify_one();
+        }
+    }
+
+    // Called with the lock held, after changing what the sleepers wait for
+    static void wakeAll(Shared & shared)
+    {
+        shared.lot.unparkAll();
+        shared.cond.notify_all();
+        shared.spare.notify_all();
+    }
+
+    // Gets a helper taking tasks for a blocked worker not made up for yet.
+    // A spare one if any, otherwise one is spawned, but only once there are
+    // tasks to take, see makeUp(). Called with the lock held.
+    static void enlist(Shared & shared)
+    {
+        if (shared.helping >= shared.wanted)
+        {
+            return;
+        }
+
+        if (shared.spares > 0)
+        {
+            shared.spare.notify_one();
+            return;
+        }
+
+        if (shared.pending == 0)
+        {
+            return;
+        }
+
+        // Helpers that left are done by the time they're seen as such
+        for (Helpers::iterator it = shared.helpers.begin(); it != shared.helpers.end();)
+        {
+            if (it->done)
+            {
+                if (it->thread.joinable())
+                {
+                    it->thread.join();
+                }
+                it = shared.helpers.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        // A helper looks itself up under the lock, once it's listed
+        shared.helpers.emplace_back();
+        Helper & entry = shared.helpers.back();
+
+        entry.done = true; // Reaped right away if it fails to start
+        entry.thread = std::thread(helper, std::ref(shared));
+        entry.done = false;
+
+        shared.helping++;
+    }
+
+    // Called for a task queued while no thread is idle, in case a blocked
+    // worker is still waiting for a helper
+    static void makeUp(Shared & shared)
+    {
+        if (shared.helping >= shared.wanted)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(shared.mutex);
+
+#ifdef THREAD_POOL_HAS_EXCEPTIONS
+        try
+        {
+            enlist(shared);
+        }
+        catch (...)
+        {
+            // Failed to spawn a helper, the next task tries again
+        }
+#else
+        enlist(shared);
+#endif
+    }
+
+    // Sleeps on the worker's own parker until woken, unless anything the
+    // worker waits for changed before it was seen idle
+    static void sleep(Shared & shared, size_t id)
+    {
+        shared.idle++;
+        shared.lot.park(id);
+
+        if (!shouldWake(shared, id) || !shared.lot.retract(id))
+        {
+            shared.lot.wait(id);
+        }
+
+        shared.idle--;
+    }
+
+    // Loads in order with publishing the worker as idle (unlike parked())
+    static bool shouldWake(const Shared & shared, size_t id)
+    {
+        return shared.exit || id >= shared.active + shared.blocked || needsPoller(shared) ||
+               (!shared.paused && (shared.pending > 0 || hasPinned(shared, id)));
+    }
+
+    static bool needsPoller(const Shared & shared)
+    {
+#ifdef THREAD_POOL_HAS_IO_URING
+        return awaitsRing(shared) && !shared.polling;
+#else
+        (void)shared;
+        return false;
+#endif
+    }
+
+#ifdef THREAD_POOL_HAS_IO_URING
+    // There is I/O in flight, or fds to watch while running
+    static bool awaitsRing(const Shared & shared)
+    {
+        return shared.inflight > 0 || (shared.watches.count > 0 && shared.run);
+    }
+#endif
+
+    // Workers beyond the active count are parked, unless making up for
+    // workers blocked in blocking()
+    static bool parked(const Shared & shared, size_t id)
+    {
+        return id >= shared.active.load(std::memory_order_relaxed) +
+                     shared.blocked.load(std::memory_order_relaxed);
+    }
+
+    // A temporary worker making up for a blocked one when none is parked. It
+    // has no local queue. Once any blocked worker returns, it steps down and
+    // is kept for the next one, up to as many as there are workers.
+    static void helper(Shared & shared)
+    {
+        std::unique_lock<std::mutex> lock(shared.mutex, std::defer_lock);
+
+        while (true)
+        {
+            if (!shared.paused.load(std::memory_order_relaxed) &&
+                shared.helping.load(std::memory_order_relaxed) <= shared.wanted.load(std::memory_order_relaxed))
+            {
+                if (Task * task = dequeueAny(shared))
+                {
+                    execute(shared, task, nullptr);
+                    continue;
+                }
+            }
+
+            lock.lock();
+
+            if (shared.helping > shared.wanted)
+            {
+                shared.helping--;
+
+                if (shared.exit || shared.spares >= shared.locals.size())
+                {
+                    break;
+                }
+
+                shared.spares++;
+                shared.spare.wait(lock,
+                    [&shared](){ return shared.exit || shared.helping < shared.wanted; });
+                shared.spares--;
+
+                if (shared.exit)
+                {
+                    break;
+                }
+
+                shared.helping++;
+                lock.unlock();
+                continue;
+            }
+
+            if (!shared.paused && shared.pending > 0)
+            {
+                lock.unlock();
+                continue;
+            }
+
+            if (shared.exit)
+            {
+                shared.helping--;
+                break;
+            }
+
+            shared.idle++;
+            shared.idleHelpers++;
+            shared.cond.wait(lock,
+                [&shared](){ return shared.exit || shared.helping > shared.wanted ||
+                                    (!shared.paused && shared.pending > 0); });
+            shared.idleHelpers--;
+            shared.idle--;
+
+            lock.unlock();
+        }
+
+        for (Helper & entry : shared.helpers)
+        {
+            if (entry.thread.get_id() == std::this_thread::get_id())
+            {
+                entry.done = true;
+            }
+        }
+    }
+
+    // Like dequeue, for threads without a local queue
+    static Task * dequeueAny(Shared & shared)
+    {
+        if (Task * task = dequeueFlow(shared))
+        {
+            return task;
+        }
+
+        if (Task * task = dequeueQueue(producerSlot(), shared))
+        {
+            return task;
+        }
+
+        size_t count = shared.locals.size();
+
+        for (size_t i = 0; i < count && shared.pending > 0; i++)
+        {
+            if (Task * task = takeLocal(shared.locals[i]->steal(), shared))
+            {
+                return task;
+            }
+        }
+
+        for (size_t i = 0; i < count && shared.pending > 0; i++)
+        {
+            if (Task * task = dequeueMailbox(*shared.mailboxes[i], shared, false))
+            {
+                return task;
+            }
+        }
+
+        return nullptr;
+    }
+
+    static Task * takeLocal(Task * task, Shared & shared)
+    {
+        if (task)
+        {
+            shared.pending--;
+        }
+
+        return task;
+    }
+
+    static void worker(size_t id, Shared & shared)
+    {
+        context() = { &shared, id };
+        shared.heaps[id]->own();
+
+        size_t turn = 0;
+
+        while (true)
+        {
+            // Work if there are tasks in the queues
+            // IMPORTANT! Must NOT hold any lock while working
+
+            if (!shared.paused.load(std::memory_order_relaxed))
+            {
+                Task * task = parked(shared, id) ? dequeuePinned(id, shared)
+                                                 : dequeue(id, shared, (turn++ & 1) != 0);
+
+                if (task)
+                {
+                    execute(shared, task, shared.counters[id].get());
+
+#ifdef THREAD_POOL_HAS_IO_URING
+                    // Completions are picked up between tasks too, unless
+                    // a worker is waiting for them
+                    IoRing * ring = shared.ring.load(std::memory_order_acquire);
+                    if (ring && !shared.polling && ring->ready())
+                    {
+                        reapRing(shared, *ring, false);
+                    }
+#endif
+                    continue;
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(shared.mutex);
+
+            // Parked workers sleep apart, so waking a worker for a new task
+            // never picks one of them. Their local queues are stolen from,
+            // while their pinned tasks are still theirs to run.
+
+            if (parked(shared, id))
+            {
+                shared.parked.wait(lock,
+                    [&shared, id](){ return shared.exit || !parked(shared, id) ||
+                                            (!shared.paused && hasPinned(shared, id)); });
+                continue;
+            }
+
+            // Tasks are drained before stopping (stopping resumes the pool)
+
+            if (!shared.paused && (shared.pending > 0 || hasPinned(shared, id)))
+            {
+                continue;
+            }
+
+#ifdef THREAD_POOL_HAS_IO_URING
+            // One idle worker waits for I/O completions and watched fds
+            // rather than sleeping here, producers wake it through the ring.
+            // I/O in flight is waited for before stopping.
+            if (needsPoller(shared))
+            {
+                shared.polling = true;
+                lock.unlock();
+
+                IoRing & ring = *shared.ring.load();
+
+                // Pairs with whoever changes these afterwards, then waking
+                // the ring when there's a poller
+                if (shared.pending == 0 && !hasPinned(shared, id) && awaitsRing(shared) && !ring.ready())
+                {
+                    ring.wait();
+                }
+
+                // Reaped before another worker may poll, so nothing it waits
+                // for is reaped from under it, but by the odd worker between tasks
+                reapRing(shared, ring, true);
+                shared.polling = false;
+                continue;
+            }
+#endif
+
+            if (shared.exit)
+            {
+                break;
+            }
+
+            // Wait until new tasks are populated, the pool is resumed or stopped
+
+            lock.unlock();
+            sleep(shared, id);
+        }
+
+        shared.heaps[id]->own(nullptr);
     }
 
 private:
     WorkersPool _workers;
     Shared      _shared;
+    Tuner       _tuner;
 };
 
 #endif // THREAD_POOL_HPP
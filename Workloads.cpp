@@ -0,0 +1,445 @@
+/*
+    Copyright 2016 Daniel Trugman
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+// Macro-benchmark driver replaying server-like traffic against a ThreadPool.
+//
+// Usage: Workloads [all|bimodal|bursty|forkjoin|openloop] [pool size] [seconds]
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+#include "ThreadPool.hpp"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// ----------------------------------------------------------------------------
+// Helpers
+// ----------------------------------------------------------------------------
+
+static void spinFor(chrono::nanoseconds duration)
+{
+    Clock::time_point until = Clock::now() + duration;
+    while (Clock::now() < until)
+    {
+    }
+}
+
+static double toMicros(Clock::duration d)
+{
+    return chrono::duration<double, micro>(d).count();
+}
+
+static void waitFor(const atomic<size_t> & counter, size_t value)
+{
+    while (counter.load(memory_order_acquire) < value)
+    {
+        this_thread::sleep_for(chrono::microseconds(100));
+    }
+}
+
+// Collects per-task latencies, each task owns a preallocated slot
+class Latencies
+{
+public:
+    explicit Latencies(size_t capacity)
+        : _samples(capacity, 0), _count(0)
+    {}
+
+    size_t reserve()
+    {
+        return _count.fetch_add(1, memory_order_relaxed);
+    }
+
+    void set(size_t slot, double micros)
+    {
+        if (slot < _samples.size())
+        {
+            _samples[slot] = micros;
+        }
+    }
+
+    size_t count() const
+    {
+        return min(_count.load(), _samples.size());
+    }
+
+    void report(const char * name, double seconds)
+    {
+        size_t n = count();
+        sort(_samples.begin(), _samples.begin() + n);
+
+        printf("%-28s %10zu tasks %12.0f tasks/s   p50 %9.1fus  p99 %9.1fus  p99.9 %9.1fus  max %9.1fus\n",
+               name, n, n / seconds,
+               percentile(n, 0.50), percentile(n, 0.99), percentile(n, 0.999),
+               n ? _samples[n - 1] : 0.0);
+    }
+
+private:
+    double percentile(size_t n, double p) const
+    {
+        return n ? _samples[min(n - 1, (size_t)(p * n))] : 0.0;
+    }
+
+    vector<double> _samples;
+    atomic<size_t> _count;
+};
+
+// ----------------------------------------------------------------------------
+// Bimodal task durations: 99% take 5us, 1% take 10ms
+// ----------------------------------------------------------------------------
+
+static chrono::nanoseconds bimodalDuration(mt19937 & rng)
+{
+    return uniform_int_distribution<int>(0, 99)(rng) == 0
+        ? chrono::nanoseconds(chrono::milliseconds(10))
+        : chrono::nanoseconds(chrono::microseconds(5));
+}
+
+static void runBimodal(size_t poolSize, double seconds)
+{
+    // Closed loop, the producer keeps a bounded number of tasks in flight
+    const size_t IN_FLIGHT = poolSize * 64;
+
+    Latencies latencies(4000000);
+    atomic<size_t> done(0);
+    size_t submitted = 0;
+    mt19937 rng(1);
+
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds));
+    {
+        ThreadPool tp(poolSize);
+
+        while (Clock::now() < end)
+        {
+            if (submitted - done.load(memory_order_acquire) >= IN_FLIGHT)
+            {
+                this_thread::yield();
+                continue;
+            }
+
+            Clock::time_point queued = Clock::now();
+            chrono::nanoseconds duration = bimodalDuration(rng);
+
+            tp.addTask([&latencies, &done, queued, duration]()
+            {
+                spinFor(duration);
+                latencies.set(latencies.reserve(), toMicros(Clock::now() - queued));
+                done.fetch_add(1, memory_order_release);
+            });
+            submitted++;
+        }
+    }
+
+    latencies.report("bimodal (closed loop)", toMicros(Clock::now() - start) / 1e6);
+}
+
+// ----------------------------------------------------------------------------
+// Bursty Poisson arrivals: several producers alternating between a quiet and
+// a bursting rate, each task takes bimodal time
+// ----------------------------------------------------------------------------
+
+static void runBursty(size_t poolSize, double seconds)
+{
+    const size_t PRODUCERS = 4;
+    const double QUIET_RATE = 2000;   // tasks/s per producer
+    const double BURST_RATE = 50000;  // tasks/s per producer
+    const chrono::milliseconds PHASE(50);
+
+    Latencies latencies(4000000);
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds));
+    {
+        ThreadPool tp(poolSize);
+        vector<thread> producers;
+
+        for (size_t p = 0; p < PRODUCERS; p++)
+        {
+            producers.emplace_back([&tp, &latencies, p, start, end, PHASE, QUIET_RATE, BURST_RATE]()
+            {
+                mt19937 rng(p + 1);
+                Clock::time_point next = Clock::now();
+
+                while (next < end)
+                {
+                    bool burst = ((next - start) / PHASE) % 4 == 0;
+                    exponential_distribution<double> gap(burst ? BURST_RATE : QUIET_RATE);
+                    next += chrono::duration_cast<Clock::duration>(chrono::duration<double>(gap(rng)));
+
+                    while (Clock::now() < next)
+                    {
+                    }
+
+                    chrono::nanoseconds duration = bimodalDuration(rng);
+                    Clock::time_point queued = next;
+
+                    tp.addTask([&latencies, queued, duration]()
+                    {
+                        spinFor(duration);
+                        latencies.set(latencies.reserve(), toMicros(Clock::now() - queued));
+                    });
+                }
+            });
+        }
+
+        for (thread & t : producers)
+        {
+            t.join();
+        }
+    }
+
+    latencies.report("bursty poisson (4 producers)", toMicros(Clock::now() - start) / 1e6);
+}
+
+// ----------------------------------------------------------------------------
+// Recursive fork-join. Tasks never block on their children, the last child to
+// finish completes the parent, so the recursion depth isn't bound by pool size
+// ----------------------------------------------------------------------------
+
+struct Join
+{
+    Join(Join * parent, uint64_t * out) : parent(parent), out(out), pending(2), left(0), right(0) {}
+
+    Join *           parent;
+    uint64_t *       out;
+    atomic<int>      pending;
+    uint64_t         left;
+    uint64_t         right;
+};
+
+static uint64_t fibSerial(unsigned n)
+{
+    return n < 2 ? n : fibSerial(n - 1) + fibSerial(n - 2);
+}
+
+static void fibComplete(Join * join, promise<void> & finished)
+{
+    while (join && join->pending.fetch_sub(1, memory_order_acq_rel) == 1)
+    {
+        *join->out = join->left + join->right;
+        Join * parent = join->parent;
+        delete join;
+        join = parent;
+    }
+
+    if (!join)
+    {
+        finished.set_value();
+    }
+}
+
+static void fibTask(ThreadPool & tp, unsigned n, Join * parent, uint64_t * out, promise<void> & finished)
+{
+    const unsigned CUTOFF = 16;
+
+    if (n < CUTOFF)
+    {
+        *out = fibSerial(n);
+        fibComplete(parent, finished);
+        return;
+    }
+
+    Join * join = new Join(parent, out);
+    tp.addTask(fibTask, ref(tp), n - 1, join, &join->left, ref(finished));
+    tp.addTask(fibTask, ref(tp), n - 2, join, &join->right, ref(finished));
+}
+
+static void quicksortTask(ThreadPool & tp, int * first, int * last,
+                          atomic<size_t> & sorted, promise<void> & finished, size_t total)
+{
+    const ptrdiff_t CUTOFF = 4096;
+
+    while (last - first > CUTOFF)
+    {
+        int pivot = first[(last - first) / 2];
+        int * middle1 = partition(first, last, [pivot](int x) { return x < pivot; });
+        int * middle2 = partition(middle1, last, [pivot](int x) { return !(pivot < x); });
+
+        // Elements equal to the pivot are in place
+        if (sorted.fetch_add(middle2 - middle1, memory_order_acq_rel) + (middle2 - middle1) == total)
+        {
+            finished.set_value();
+            return;
+        }
+
+        tp.addTask(quicksortTask, ref(tp), middle2, last, ref(sorted), ref(finished), total);
+        last = middle1;
+    }
+
+    sort(first, last);
+
+    if (sorted.fetch_add(last - first, memory_order_acq_rel) + (last - first) == total)
+    {
+        finished.set_value();
+    }
+}
+
+static void runForkJoin(size_t poolSize, double /* seconds */)
+{
+    {
+        const unsigned N = 32;
+        ThreadPool tp(poolSize);
+        uint64_t result = 0;
+        promise<void> finished;
+
+        Clock::time_point start = Clock::now();
+        tp.addTask(fibTask, ref(tp), N, nullptr, &result, ref(finished));
+        finished.get_future().wait();
+        double micros = toMicros(Clock::now() - start);
+
+        printf("%-28s fib(%u) = %llu in %.1fms (serial cutoff 16)\n",
+               "fork-join fib", N, (unsigned long long)result, micros / 1000);
+    }
+
+    {
+        const size_t N = 4000000;
+        ThreadPool tp(poolSize);
+        vector<int> data(N);
+        mt19937 rng(1);
+        for (int & x : data)
+        {
+            x = (int)rng();
+        }
+
+        atomic<size_t> sorted(0);
+        promise<void> finished;
+
+        Clock::time_point start = Clock::now();
+        tp.addTask(quicksortTask, ref(tp), data.data(), data.data() + N, ref(sorted), ref(finished), N);
+        finished.get_future().wait();
+        double micros = toMicros(Clock::now() - start);
+
+        printf("%-28s %zu ints in %.1fms (%s)\n",
+               "fork-join quicksort", N, micros / 1000,
+               is_sorted(data.begin(), data.end()) ? "sorted" : "NOT SORTED");
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Open loop load generator: arrivals follow a fixed schedule regardless of
+// completions, and latency is measured from the scheduled arrival time so
+// queueing isn't hidden (no coordinated omission). Sweeping the offered rate
+// gives a latency-under-load curve.
+// ----------------------------------------------------------------------------
+
+static void runOpenLoop(size_t poolSize, double seconds)
+{
+    const chrono::microseconds SERVICE(20);
+
+    // Capacity of the pool if tasks were free to schedule
+    double capacity = poolSize * 1e6 / SERVICE.count();
+    double step = seconds / 10;
+
+    printf("open loop, %zu workers, %lldus tasks, capacity ~%.0f tasks/s\n",
+           poolSize, (long long)SERVICE.count(), capacity);
+
+    for (int load = 10; load <= 100; load += 10)
+    {
+        double rate = capacity * load / 100;
+        Clock::duration interval = chrono::duration_cast<Clock::duration>(chrono::duration<double>(1 / rate));
+        size_t arrivals = max<size_t>(1, (size_t)(rate * step));
+
+        Latencies latencies(arrivals);
+        atomic<size_t> done(0);
+
+        Clock::time_point start = Clock::now();
+        {
+            ThreadPool tp(poolSize);
+
+            for (size_t i = 0; i < arrivals; i++)
+            {
+                Clock::time_point scheduled = start + interval * i;
+
+                while (Clock::now() < scheduled)
+                {
+                }
+
+                tp.addTask([&latencies, &done, scheduled, SERVICE]()
+                {
+                    spinFor(SERVICE);
+                    latencies.set(latencies.reserve(), toMicros(Clock::now() - scheduled));
+                    done.fetch_add(1, memory_order_release);
+                });
+            }
+
+            waitFor(done, arrivals);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "  offered %3d%% (%.0f/s)", load, rate);
+        latencies.report(name, toMicros(Clock::now() - start) / 1e6);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Driver
+// ----------------------------------------------------------------------------
+
+int main(int argc, char * argv[])
+{
+    string workload = argc > 1 ? argv[1] : "all";
+    size_t poolSize = argc > 2 ? strtoul(argv[2], nullptr, 10) : thread::hardware_concurrency();
+    double seconds  = argc > 3 ? strtod(argv[3], nullptr) : 2.0;
+
+    if (poolSize == 0)
+    {
+        poolSize = 1;
+    }
+
+    bool all = (workload == "all");
+    bool known = false;
+
+    if (all || workload == "bimodal")
+    {
+        runBimodal(poolSize, seconds);
+        known = true;
+    }
+
+    if (all || workload == "bursty")
+    {
+        runBursty(poolSize, seconds);
+        known = true;
+    }
+
+    if (all || workload == "forkjoin")
+    {
+        runForkJoin(poolSize, seconds);
+        known = true;
+    }
+
+    if (all || workload == "openloop")
+    {
+        runOpenLoop(poolSize, seconds);
+        known = true;
+    }
+
+    if (!known)
+    {
+        fprintf(stderr, "Usage: %s [all|bimodal|bursty|forkjoin|openloop] [pool size] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    return 0;
+}